@@ -1,291 +1,3643 @@
 #include "my_malloc.h"
 #include <stdio.h>
-#include <limits.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifndef PTHREAD_LOCKS
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#if defined(PERCPU) && !defined(__x86_64__)
+#undef PERCPU // the restartable sequences are written for x86-64 only
+#endif
+#ifdef PERCPU
+#include <stddef.h>
+#include <sys/syscall.h>
+#if defined(__has_include) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h> // glibc registers rseq for every thread
+#define GLIBC_RSEQ
+#else
+#include <linux/rseq.h>
+#define RSEQ_SIG 0x53053053
+#endif
+#endif
 
 
-// free list data
-static Header * free_list = NULL; // entry of the free blocks cyclic ll
-static Header base; // the very first Header
+// links stored in the payload of a free block, the last word of a free
+// block repeats its size (boundary tag)
+typedef struct links_t {
+  Header * next; // next block in the same bin
+  Header * prev; // previous block in the same bin
+} Links;
 
+#define FOOTER(h) (((size_t *)((h) + (h)->size))[-1])
+#define MIN_UNITS (1 + (sizeof(Links) + sizeof(size_t) + sizeof(Header) - 1) / sizeof(Header))
 
-// mutexes
-static pthread_mutex_t free_list_mutex = PTHREAD_MUTEX_INITIALIZER; 
-static pthread_mutex_t sbrk_mutex = PTHREAD_MUTEX_INITIALIZER;
+// boundary tag bits
+#define PINUSE 1 // previous block is in use
+#define CINUSE 2 // this block is in use
+
+#define LINKS(h) ((Links *)((h) + 1))
+#define ALIGN_UP(p, a) (((uintptr_t)(p) + (a) - 1) & ~(uintptr_t)((a) - 1))
+
+// heap growth: a heap reserves address space in regions, the first of
+// REGION_MIN bytes and every further one twice as large up to REGION_SIZE,
+// so the many heaps of many threads fit in the spaces below. It first
+// commits MIN_ALLOC bytes, then every further growth doubles up to
+// MAX_ALLOC. Tunables can be set at build time (see Makefile), REGION_MIN
+// must be a multiple of COMMIT_UNIT and at most REGION_SIZE
+#ifndef REGION_SIZE
+#define REGION_SIZE ((size_t)1 << 30)
+#endif
+#ifndef REGION_MIN
+#define REGION_MIN (64 * MIN_ALLOC)
+#endif
+
+// regions are handed out by an atomic bump over spaces of SPACE_SIZE
+// bytes of reserved address space. The bump word holds the index of the
+// current space above SPACE_SHIFT and the bytes handed out from it below.
+// It starts at index 0 used up, so every space, the first one included,
+// is published before the word moves to its index. A thread adds to a used
+// up space at most once, so the count below can not carry into the index.
+// Once MAX_SPACES are used up regions are reserved on their own
+#define SPACE_SHIFT 56
+#define SPACE_MASK (((unsigned long)1 << SPACE_SHIFT) - 1)
+#define SPACE_SIZE ((size_t)1 << 36)
+#define MAX_SPACES 64
+#ifndef MIN_ALLOC
+#define MIN_ALLOC ((size_t)1 << 16)
+#endif
+#ifndef MAX_ALLOC
+#define MAX_ALLOC ((size_t)1 << 21)
+#endif
+
+// large requests: MMAP_THRESHOLD bytes and more get a mapping of their own
+// that is unmapped on free. Such a block has no owner heap
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD ((size_t)1 << 17)
+#endif
+#define PAGE_SIZE 4096
+#define IS_MMAPPED(b) ((b)->heap == NULL)
+
+// hugepages: with HUGEPAGES, spaces and mappings of HUGE_PAGE_SIZE bytes
+// and more start on a hugepage boundary and are advised to be backed by
+// transparent hugepages. Heaps commit and give back whole hugepages only,
+// so none is split (REGION_SIZE must be a multiple of HUGE_PAGE_SIZE).
+// Large mappings of nearly whole hugepages try MAP_HUGETLB first
+#define HUGE_SHIFT 21
+#define HUGE_PAGE_SIZE ((size_t)1 << HUGE_SHIFT)
+#ifdef HUGEPAGES
+#define COMMIT_UNIT HUGE_PAGE_SIZE
+
+// hugepage occupancy: a two level radix map from address >> HUGE_SHIFT to
+// the units of in-use heap blocks in that hugepage, for 48-bit addresses.
+// Allocation takes the fit in the fullest of up to HUGE_CANDIDATES
+// hugepages and small objects the fullest of as many spans, so sparse
+// hugepages drain and can be released
+#define HUGEMAP_BITS 14
+#define HUGEMAP_SIZE (1 << HUGEMAP_BITS)
+#define HUGEMAP_ROOT (1 << (48 - HUGE_SHIFT - HUGEMAP_BITS))
+#define HUGE_CANDIDATES 8
+#else
+#define COMMIT_UNIT PAGE_SIZE
+#endif
+
+// cache of freed large mappings, reused by requests they fit within a slack
+// of 1/MMAP_CACHE_SLACK. At most MMAP_CACHE_SLOTS mappings and
+// MMAP_CACHE_BYTES bytes are kept, none longer than MMAP_CACHE_AGE ms
+#ifndef MMAP_CACHE_BYTES
+#define MMAP_CACHE_BYTES ((size_t)1 << 26)
+#endif
+#ifndef MMAP_CACHE_AGE
+#define MMAP_CACHE_AGE 1000
+#endif
+#define MMAP_CACHE_SLOTS 16
+#define MMAP_CACHE_SLACK 4
+
+// giving memory back: a top of TRIM_THRESHOLD bytes and more that ends at
+// the program break is cut back to TOP_PAD bytes. The pages inside a free
+// block of RELEASE_THRESHOLD bytes and more are released, the size of the
+// block at the time is kept after its links
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD ((size_t)1 << 22)
+#endif
+#define TOP_PAD MIN_ALLOC
+#ifndef RELEASE_THRESHOLD
+#define RELEASE_THRESHOLD ((size_t)1 << 18)
+#endif
+#define RELEASED(h) (*(size_t *)((char *)((h) + 1) + FREE_LINKS))
+
+// depot: a thread heap whose bins hold more than DEPOT_THRESHOLD bytes
+// gives its largest free blocks of DEPOT_MIN bytes and more to a shared
+// depot, until they hold half of that or the depot holds DEPOT_MAX bytes.
+// A block of DEPOT_MIN bytes and more freed by another thread than its
+// owner goes to the depot right away instead of waiting on the remote
+// stack of a heap whose thread may not allocate for long. A chunk is cut
+// out of the block between an in-use guard and fence that keep it from
+// coalescing with the blocks of the heap it came from. The guard records
+// that heap, the fence where the chunk starts. With HUGEPAGES it is cut on
+// hugepage boundaries and the pieces around stay in the heap. A heap that
+// needs to grow takes a chunk from the depot first and makes it its top.
+// Once all of a lent chunk is free again it goes back to the depot whole,
+// and the heap it came from takes its own chunks back on a miss and
+// merges them into its free blocks, guard and fence included. Chunks in
+// the depot are decommitted, so it holds address space only. They are
+// binned by size, DEPOT_MIN bytes and up to twice as many in the first
+// bin, and linked to the heap they came from as well
+#ifndef DEPOT_THRESHOLD
+#define DEPOT_THRESHOLD ((size_t)1 << 23)
+#endif
+#ifndef DEPOT_MAX
+#define DEPOT_MAX (128 * DEPOT_THRESHOLD)
+#endif
+#define DEPOT_MIN RELEASE_THRESHOLD
+#ifdef HUGEPAGES
+#define DEPOT_ALIGN HUGE_PAGE_SIZE
+#else
+#define DEPOT_ALIGN sizeof(Header)
+#endif
+#define DEPOT_BINS 16
+#define DEPOT_SCAN 8 // chunks tried in the bin of a request
+#define LENT(h) ((Links *)(&RELEASED(h) + 1)) // links among the chunks of a heap
+
+#ifdef SCAVENGER
+// background release: instead of freeing threads, a scavenger thread
+// releases free blocks of RELEASE_THRESHOLD bytes and more once they have
+// been free for DECAY_TIME ms. Such blocks are kept on a decay list of
+// their heap in the order they were binned, so the aged ones are at its
+// head. It claims at most SCAVENGE_BATCH blocks per lock hold and calls
+// madvise with the lock dropped
+#ifndef DECAY_TIME
+#define DECAY_TIME 10000
+#endif
+#define SCAVENGE_BATCH 16
+#define FREED_AT(h) (((unsigned long *)&RELEASED(h))[1]) // ms, set when binned
+#define DECAY(h) ((Links *)(&FREED_AT(h) + 1)) // links of the decay list
+#define DECAYING(h) ((h)->size >= RELEASE_THRESHOLD / sizeof(Header) && RELEASED(h) != (h)->size)
+#endif
+
+// arenas: the lock version spreads threads round robin over
+// ARENAS_PER_CPU arenas per online CPU, at most MAX_ARENAS. An arena is a
+// heap with a lock of its own. A thread that finds its arena locked moves
+// on to the first free one. Blocks and spans record their arena, so a
+// free goes back to it whichever thread frees
+#ifndef ARENAS_PER_CPU
+#define ARENAS_PER_CPU 2
+#endif
+#ifndef MAX_ARENAS
+#define MAX_ARENAS 64
+#endif
+
+// locks: the allocator's critical sections are short, so a thread that
+// finds a lock held first spins on it for up to LOCK_SPINS rounds of
+// pause before it parks on a futex until the holder wakes it. On a single
+// CPU the holder can not run while others spin, so they park at once.
+// PTHREAD_LOCKS builds the locks on pthread mutexes instead, for
+// comparison. LOCK_STATS counts acquisitions, see ts_lock_stats
+#ifndef LOCK_SPINS
+#define LOCK_SPINS 100
+#endif
+#ifndef LOCK_STATS
+#define LOCK_STATS_INITIALIZER
+#else
+#define LOCK_STATS_INITIALIZER , 0, 0, 0
+#endif
+#ifndef PTHREAD_LOCKS
+#define LOCK_INITIALIZER { 0 LOCK_STATS_INITIALIZER }
+#else
+#define LOCK_INITIALIZER { PTHREAD_MUTEX_INITIALIZER LOCK_STATS_INITIALIZER }
+#endif
+#ifdef LOCK_STATS
+#define LOCK_COUNT(l, field, n) ((l)->field += (n))
+#else
+#define LOCK_COUNT(l, field, n) ((void)(n))
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// class locks: within an arena the spans of every slab class have a lock
+// of their own, padded to a cache line, so threads allocating different
+// sizes do not contend. The lock of the arena stays the coarse lock of
+// large blocks, the spare span and the top. It is only taken inside a
+// class lock, when a span is set up or given back
+#define CACHE_LINE 64
+#define LARGE_CLASS NUM_SLAB_CLASSES // the coarse lock in arena_lock
+
+typedef union class_lock_t {
+  Lock lock;
+  char pad[CACHE_LINE];
+} ClassLock;
+_Static_assert(sizeof(ClassLock) == CACHE_LINE, "class lock spans cache lines");
+
+// thread cache: in front of the arenas every thread keeps stacks of
+// up to TCACHE_COUNT small objects per slab class. The objects themselves
+// are not written to, so refilled ones are only faulted in when used. An
+// empty stack is refilled and a full one flushed TCACHE_BATCH objects at
+// a time under a single hold of the class lock
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT 32
+#endif
+#define TCACHE_BATCH (TCACHE_COUNT / 2)
+
+typedef struct tcache_t {
+  void * objs[NUM_SLAB_CLASSES][TCACHE_COUNT]; // stacks of objects by class
+  unsigned count[NUM_SLAB_CLASSES];
+  int state; // 0 before first use, 1 in use, 2 per-CPU caches in use,
+             // -1 once the thread exits
+} TCache;
+
+#ifdef PERCPU
+// per-CPU caches: with PERCPU the stacks of the thread cache are kept per
+// CPU instead of per thread, so memory held in caches scales with the
+// number of CPUs and idle threads hold none. The stacks of a CPU take
+// 1 << PCPU_SHIFT bytes, every class a count followed by TCACHE_COUNT
+// slots. They are only changed in restartable sequences (rseq), which the
+// kernel aborts and restarts when the thread is preempted or migrated.
+// Threads that can not register rseq keep a thread cache as before
+#define PCPU_SHIFT 13
+#define PCPU_STRIDE ((TCACHE_COUNT + 1) * sizeof(void *))
+_Static_assert(NUM_SLAB_CLASSES * PCPU_STRIDE <= (1 << PCPU_SHIFT), "per-CPU stacks overflow");
+#endif
+
+typedef struct cached_map_t {
+  Header * block; // NULL if the slot is empty
+  unsigned long stamp; // time of the free in ms
+} CachedMap;
+
+#ifndef TLSF_VERSION
+// links stored in the payload of a free block that sits in a tree bin
+typedef struct tree_links_t {
+  Header * left;
+  Header * right;
+  Header * parent;
+  size_t red; // red-black color
+} TreeLinks;
+
+#define TREE(h) ((TreeLinks *)((h) + 1))
+#define FREE_LINKS sizeof(TreeLinks)
+#else
+#define FREE_LINKS sizeof(Links)
+#endif
+
+
+// arena data
+static Heap arenas[MAX_ARENAS]; // heaps shared by all threads
+static unsigned arena_count; // arenas in use
+static unsigned arena_next; // arena of the next thread
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static ClassLock class_locks[MAX_ARENAS][NUM_SLAB_CLASSES] __attribute__((aligned(CACHE_LINE)));
+
+
+// span lookup: a two level radix map from address >> SPAN_SHIFT to the
+// span covering it, for 48-bit addresses
+#define PAGEMAP_BITS 16
+#define PAGEMAP_SIZE (1 << PAGEMAP_BITS)
+static Span ** pagemap[PAGEMAP_SIZE];
+
+
+#ifdef HUGEPAGES
+// hugepage occupancy data
+static unsigned * hugemap[HUGEMAP_ROOT]; // units in use by hugepage
+#endif
+
+
+// bytes committed to heaps
+static size_t footprint;
+
+
+// address space data
+static unsigned long space_word = SPACE_SIZE; // space index and bytes handed out
+static char * spaces[MAX_SPACES]; // reserved spaces by index, from 1
+
+
+// depot data
+static Header * depot[DEPOT_BINS]; // chunks given up by thread heaps by size
+static size_t depot_bytes; // bytes of all chunks in the depot
+static Lock depot_lock = LOCK_INITIALIZER;
+
+
+// large mapping cache data
+static CachedMap mmap_cache[MMAP_CACHE_SLOTS];
+static size_t mmap_cache_bytes; // bytes of all cached mappings
+#ifdef HUGEPAGES
+static int hugetlb_failed; // MAP_HUGETLB was refused, the pool is empty
+#endif
+
+
+// locks
+static Lock pagemap_lock = LOCK_INITIALIZER;
+static Lock mmap_cache_lock = LOCK_INITIALIZER;
+static Lock space_lock = LOCK_INITIALIZER;
+#ifdef HUGEPAGES
+static Lock hugemap_lock = LOCK_INITIALIZER;
+#endif
+#ifndef PTHREAD_LOCKS
+static int lock_spins = -1; // spins before parking, set on first contention
+#endif
+
+
+// orphan data
+static Lock orphans_lock = LOCK_INITIALIZER;
+static Heap * orphans; // heaps of exited threads, linked by orphan
+
+
+#ifdef SCAVENGER
+// scavenger data
+static pthread_once_t scavenger_once = PTHREAD_ONCE_INIT;
+static Lock heaps_lock = LOCK_INITIALIZER;
+static Heap * heaps; // thread heaps, linked by next
+#endif
 
 
 // TLS static data
-static __thread Header * tls_free_list = NULL;
-static __thread Header tls_base;
+static __thread Heap * tls_heap = NULL; // owned by one thread at a time
+static pthread_key_t heap_key; // orphans the heap on thread exit
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+static __thread Heap * tls_arena = NULL; // arena of the lock version
+static __thread TCache tcache; // small objects of the arenas
+static pthread_key_t tcache_key; // flushes the cache on thread exit
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+#ifdef PERCPU
+static __thread struct rseq * tls_rseq; // rseq area of the thread
+static __thread struct rseq rseq_area; // registered here if glibc did not
+#endif
+
+
+#ifdef PERCPU
+// per-CPU cache data
+static char * pcpu; // stacks of all CPUs
+static unsigned pcpu_count; // CPUs that have stacks
+static pthread_once_t pcpu_once = PTHREAD_ONCE_INIT;
+#endif
 
 
 // prototypes
-Header * malloc_sys(size_t n, Header ** fl, int need);
-void * processBlock(Header * start, size_t size);
-void ts_sys_free_lock(void * ptr);
-void insert_free_list(void * ptr, Header ** fl);
-void coalescing_blocks(Header * toAdd, Header * block, Header ** fl);
-void * my_malloc(size_t n, Header ** fl, int need_lock);
+Header * malloc_sys(size_t n, Heap * h);
+static char * region_reserve(size_t size);
+static int space_grow(size_t size);
+static char * map_pages(size_t size, int prot, int flags);
+void * processBlock(Heap * h, Header * start, size_t size);
+Header * carve_block(Heap * h, Header * block, Header * start, size_t units);
+Header * top_alloc(Heap * h, size_t units);
+Header * alloc_aligned(Heap * h, size_t units, size_t align);
+void * mmap_alloc(size_t n);
+void mmap_free(Header * block);
+static unsigned long now_ms(void);
+static Header * mmap_cache_get(size_t bytes);
+static int mmap_cache_put(Header * block);
+static unsigned mmap_cache_expire(unsigned long now, Header ** drop);
+static void mmap_cache_unmap(Header ** drop, unsigned ndrop);
+#ifdef SCAVENGER
+static void mmap_cache_trim(void);
+#endif
+static void heap_trim(Heap * h);
+static void depot_give(Heap * h);
+static int depot_put(Heap * h, Header * block);
+static int depot_cut(Header * block);
+static Header * depot_take(Heap * h, size_t units);
+static void depot_add(Header * chunk);
+static void depot_return(Header * chunk);
+static int depot_reclaim(Heap * h);
+static void depot_merge(Heap * h, Header * chunk);
+static unsigned depot_bin(size_t units);
+static void depot_insert(Header * chunk);
+static void depot_remove(Header * chunk);
+static int depot_commit(Header * chunk, int commit);
+static void release_block(Header * block);
+static void lock_init(Lock * l);
+static int lock_try(Lock * l);
+static void lock_acquire(Lock * l);
+static void lock_wait(Lock * l);
+static void lock_release(Lock * l);
+#ifdef LOCK_STATS
+static void lock_stats_add(LockStats * stats, Lock * l);
+#endif
+static void heap_lock(Heap * h, int need_lock);
+static void heap_unlock(Heap * h, int need_lock);
+static void arena_init(void);
+static Heap * arena_get(void);
+static Lock * class_lock(Heap * h, unsigned cls);
+static Heap * arena_lock(Heap * h, unsigned cls);
+#ifdef SCAVENGER
+static void scavenger_start(void);
+static void * scavenger(void * arg);
+static void decay_push(Heap * h, Header * block);
+static void decay_remove(Heap * h, Header * block);
+static void scavenge(Heap * h, int need_lock);
+#endif
+void insert_free_list(void * ptr, Heap * h);
+static void remote_push(Heap * h, void * ptr);
+static void remote_drain(Heap * h);
+void coalescing_blocks(Header * toAdd, Header * block, Heap * h);
+void * my_malloc(size_t n, Heap * h, int need_lock);
+Heap * heap_new(void);
+static int heap_start(void);
+static void heap_key_init(void);
+static void heap_exit(void * arg);
+static Span * pagemap_get(void * ptr);
+static int pagemap_set(Span * span, Span * value);
+static unsigned slab_class(size_t n);
+static Span * span_new(Heap * h, unsigned cls, int need_lock);
+static void * slab_malloc(Heap * h, size_t n, int need_lock);
+static void slab_free(Heap * h, Span * span, void * ptr, int need_lock);
+static int tcache_start(void);
+static void tcache_key_init(void);
+static void * tcache_refill(size_t n);
+static void tcache_flush(unsigned cls, unsigned count);
+static void tcache_exit(void * arg);
+#ifdef PERCPU
+static int rseq_start(void);
+static void percpu_init(void);
+static void * percpu_pop(unsigned cls);
+static int percpu_push(unsigned cls, void * obj);
+static void * percpu_refill(size_t n);
+static unsigned percpu_flush(unsigned cls);
+#endif
+static void cache_release(void ** objs, unsigned count);
+#ifdef HUGEPAGES
+static int hugemap_grow(char * lo, char * hi);
+static unsigned * huge_used(void * ptr);
+static void huge_account(Header * block, int in_use);
+static Header * huge_pick(Header * best, size_t units, int list);
+static void span_pick(Heap * h, unsigned cls);
+#endif
+#ifdef TLSF_VERSION
+static void mapping(size_t units, unsigned * fl, unsigned * sl);
+static size_t search_size(size_t units);
+#else
+static unsigned bin_index(size_t units);
+static unsigned next_bin(Heap * h, unsigned idx);
+static void tree_insert(Header ** root, Header * block);
+static void tree_remove(Header ** root, Header * block);
+static Header * tree_search(Header * root, size_t units);
+#ifdef HUGEPAGES
+static Header * tree_next(Header * node);
+#endif
+#endif
+static void list_push(Header ** head, Header * block);
+static void list_remove(Header ** head, Header * block);
+static void bin_insert(Heap * h, Header * block);
+static void bin_remove(Heap * h, Header * block);
+static Header * find_block(Heap * h, size_t units);
+static Header * largest_block(Heap * h);
 
 
 /* ts_malloc_lock
  * ---------------
- * Best fit memory allocator. Iterate through the linked list, find the
- * smallest block that fits. If no such block found, ask OS for space.
+ * Best fit memory allocator. Search the segregated free lists of the
+ * thread's arena for the smallest block that fits. If no such block found,
+ * ask OS for space.
+ * Small requests are served from the thread cache first, without the lock,
+ * or with PERCPU from the cache of the CPU.
  *
  * size: number of bytes
- * 
+ *
  * return: pointer the new space
  */
 void * ts_malloc_lock(size_t size) {
-  my_malloc(size, &free_list, 1);
+  if (size < SLAB_MAX) {
+    unsigned cls = slab_class(size);
+#ifdef PERCPU
+    if (tcache.state == 2) {
+      void * obj = percpu_pop(cls);
+      if (obj) {
+        return obj;
+      }
+    }
+#endif
+    if (tcache.count[cls]) {
+      return tcache.objs[cls][--tcache.count[cls]];
+    }
+    void * obj = tcache_refill(size);
+    if (obj) {
+      return obj;
+    }
+  }
+  return my_malloc(size, arena_get(), 1);
 }
 
 
-/* processBlock
- * -------------
- * allocate from a suitable sized block by chopping memory of size 'size'
- * and update related Header data.
- * 
- * start: the header of block to be chopped allocated
- * size: size of memory in request
- * 
- * return: the pointer to the memory following the chopped out block
+/* ts_footprint
+ * ------------
+ * Memory committed to heaps, the counterpart of the data segment size.
+ * Large blocks mapped on their own are not counted.
+ *
+ * return: committed bytes
  */
-void * processBlock(Header * start, size_t size) {
-  start->size -= size;
-  start += start->size;
-  start->size = size;
-  return (void *)(start + 1);
+size_t ts_footprint(void) {
+  return __atomic_load_n(&footprint, __ATOMIC_RELAXED);
 }
 
 
-/* malloc_sys
+/* ts_lock_stats
  * -------------
- * malloc uses this function to ask OS for more space to add to
- * free list. sbrk is called to increment the program break and return the
- * last program break, which is the pointer to new space. The minmum request
- * amount is defined by MIN_ALLOC, and the amount is the multiple of the
- * requested number of header.
- *
- * num_units: number of header-sized units
- * fl: double pointer to the entry node of the list
- * need: use of lock or not
- * 
- * return: new free list starting pointer
- */
-Header * malloc_sys(size_t num_units, Header ** fl, int need) {
-  if (need) {
-    pthread_mutex_unlock(&free_list_mutex); 
-  }
-  pthread_mutex_lock(&sbrk_mutex); // sbrk lock
-  char * ptr = sbrk(num_units * sizeof(Header));
-  pthread_mutex_unlock(&sbrk_mutex); // sbrk unlock
-  if (ptr == (char *) -1) {
-    return NULL;
+ * Acquisitions of all allocator locks so far, all zero unless built with
+ * LOCK_STATS. The counters are read without the locks, so the sums of a
+ * running program are approximate. Pthread locks do not count parking.
+ *
+ * stats: filled with the sums
+ */
+void ts_lock_stats(LockStats * stats) {
+  stats->acquired = stats->contended = stats->parked = 0;
+#ifdef LOCK_STATS
+  Lock * locks[] = {&pagemap_lock, &mmap_cache_lock, &space_lock, &depot_lock, &orphans_lock,
+#ifdef HUGEPAGES
+                    &hugemap_lock,
+#endif
+#ifdef SCAVENGER
+                    &heaps_lock,
+#endif
+  };
+  for (unsigned i = 0; i < sizeof(locks) / sizeof(locks[0]); i++) {
+    lock_stats_add(stats, locks[i]);
   }
-  Header * header = (Header *)ptr;
-  header->size = num_units;
-  header->tid = pthread_self();
-  if (need) {
-    ts_sys_free_lock((void *)(header + 1));
+  unsigned count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+  for (unsigned i = 0; i < count; i++) {
+    lock_stats_add(stats, &arenas[i].lock);
+    for (unsigned cls = 0; cls < NUM_SLAB_CLASSES; cls++) {
+      lock_stats_add(stats, &class_locks[i][cls].lock);
+    }
   }
-  else {
-    insert_free_list((void *)(header + 1), fl);
+#ifdef SCAVENGER
+  lock_acquire(&heaps_lock);
+  Heap * h = heaps;
+  lock_release(&heaps_lock);
+  for (; h; h = h->next) {
+    lock_stats_add(stats, &h->lock);
   }
-  return *fl;
+#endif
+#endif
 }
 
 
-/* ts_free_lock
- * ------------
- * Public thread-safe free operation for external free call.
- * Thread safety is achieved by using pthread mutex lock.
+#ifdef LOCK_STATS
+/* lock_stats_add
+ * --------------
+ * Add the counters of a lock to sums.
  *
- * ptr: space to be free and inserted into free list
+ * stats: sums
+ * l: lock
  */
-void ts_free_lock(void * ptr) {
-  pthread_mutex_lock(&free_list_mutex); // locking free_list: insert & search again
-  insert_free_list(ptr, &free_list);
-  // free_list = insert_free_list(ptr);
-  pthread_mutex_unlock(&free_list_mutex);
+static void lock_stats_add(LockStats * stats, Lock * l) {
+  stats->acquired += __atomic_load_n(&l->acquired, __ATOMIC_RELAXED);
+  stats->contended += __atomic_load_n(&l->contended, __ATOMIC_RELAXED);
+  stats->parked += __atomic_load_n(&l->parked, __ATOMIC_RELAXED);
 }
+#endif
 
 
-/* ts_sys_free_lock
- * -----------------
- * Private thread-safe free operation used after calling sbrk to insert
- * a new allocated block into the free list. The mutex will not be 
- * immediately unlocked until the block is allocated to user.
- * 
- * ptr: space to be free and inserted into free list
+/* list_push
+ * ---------
+ * Push a free block on the front of a doubly linked bin list.
+ *
+ * head: first block of the list
+ * block: free block to add
  */
-void ts_sys_free_lock(void * ptr) {
-  pthread_mutex_lock(&free_list_mutex);
-  insert_free_list(ptr, &free_list);
+static inline void list_push(Header ** head, Header * block) {
+  LINKS(block)->prev = NULL;
+  LINKS(block)->next = *head;
+  if (*head) {
+    LINKS(*head)->prev = block;
+  }
+  *head = block;
 }
 
 
-/* insert_free_list
- * ----------------
- * Take a pointer to a block of memory and insert it to the free list
- * managed by my_malloc. Searching the free list arena to find the right
- * place according to its address. The list is address-sorted.
- * 
- * ptr: pointer to the block of memory to insert
- * fl: double pointer to the entry node of the list
+/* list_remove
+ * -----------
+ * Unlink a free block from a doubly linked bin list.
+ *
+ * head: first block of the list
+ * block: free block in the list
  */
-void insert_free_list(void * ptr, Header ** fl) {
-  Header * toAdd = (Header *)ptr - 1;
-  if (toAdd->tid != pthread_self()) {
+static inline void list_remove(Header ** head, Header * block) {
+  Header * prev = LINKS(block)->prev, * next = LINKS(block)->next;
+  if (prev) {
+    LINKS(prev)->next = next;
+  }
+  else {
+    *head = next;
+  }
+  if (next) {
+    LINKS(next)->prev = prev;
+  }
+}
+
+
+#ifdef TLSF_VERSION
+/* mapping
+ * -------
+ * Map a block size to its first and second level list. Sizes below
+ * SL_COUNT units map one to one into the lists of first level 0.
+ *
+ * units: block size in header-sized units
+ * fl: first level index output
+ * sl: second level index output
+ */
+static inline void mapping(size_t units, unsigned * fl, unsigned * sl) {
+  if (units < SL_COUNT) {
+    *fl = 0;
+    *sl = units;
     return;
   }
-  Header * temp = *fl;
-  while (1) {
-    if ((toAdd > temp && toAdd < temp->next) // inside the arena
-    || (temp >= temp->next && (toAdd > temp || toAdd < temp->next))) { // outside
-      break;
+  unsigned lg = BITS_PER_WORD - 1 - __builtin_clzl(units);
+  *fl = lg - SL_BITS + 1;
+  *sl = (units >> (lg - SL_BITS)) ^ SL_COUNT;
+}
+
+
+/* search_size
+ * -----------
+ * Round a request up to the next list boundary, so that every block in the
+ * list it maps to is large enough.
+ *
+ * units: requested size in header-sized units
+ *
+ * return: rounded size in header-sized units
+ */
+static inline size_t search_size(size_t units) {
+  if (units >= SL_COUNT) {
+    unsigned lg = BITS_PER_WORD - 1 - __builtin_clzl(units);
+    units += (1UL << (lg - SL_BITS)) - 1;
+  }
+  return units;
+}
+
+
+/* bin_insert
+ * ----------
+ * Push a free block on the front of the list of its size class and mark
+ * the list and its first level as non-empty.
+ *
+ * h: heap owning the lists
+ * block: free block with a valid size
+ */
+static inline void bin_insert(Heap * h, Header * block) {
+  unsigned fl, sl;
+  mapping(block->size, &fl, &sl);
+  list_push(&h->bins[fl][sl], block);
+  h->free_units += block->size;
+  h->fl_bitmap |= 1UL << fl;
+  h->sl_bitmap[fl] |= 1U << sl;
+#ifdef SCAVENGER
+  if (DECAYING(block)) {
+    decay_push(h, block);
+  }
+#endif
+}
+
+
+/* bin_remove
+ * ----------
+ * Unlink a free block from its list. Must be called before the size of the
+ * block changes.
+ *
+ * h: heap owning the lists
+ * block: free block currently in a list
+ */
+static inline void bin_remove(Heap * h, Header * block) {
+  unsigned fl, sl;
+  mapping(block->size, &fl, &sl);
+  list_remove(&h->bins[fl][sl], block);
+  h->free_units -= block->size;
+#ifdef SCAVENGER
+  if (DECAYING(block)) {
+    decay_remove(h, block);
+  }
+#endif
+  if (h->bins[fl][sl] == NULL) {
+    h->sl_bitmap[fl] &= ~(1U << sl);
+    if (h->sl_bitmap[fl] == 0) {
+      h->fl_bitmap &= ~(1UL << fl);
     }
-    temp = temp->next;
   }
-  coalescing_blocks(toAdd, temp, fl);
 }
 
 
-/* coalescing_blocks
- * -----------------
- * While inserting block into the free list, coalescing with adjacent 
- * blocks if possible
- * 
- * toAdd: block to be inserted
- * block: block in the free list
- * fl: double pointer to the entry node of the list
+/* find_block
+ * ----------
+ * Good fit search in constant time. The request is rounded up to the next
+ * list boundary so that the head of any list found by the bitmaps fits,
+ * no list is ever walked. With HUGEPAGES a few blocks of that list are
+ * compared for the fullest hugepage.
+ *
+ * h: heap to search
+ * units: requested size in header-sized units
+ *
+ * return: block to allocate from, NULL if the heap has none
+ */
+static Header * find_block(Heap * h, size_t units) {
+  unsigned fl, sl;
+  mapping(search_size(units), &fl, &sl);
+  unsigned sl_map = h->sl_bitmap[fl] & (~0U << sl);
+  if (sl_map == 0) {
+    unsigned long fl_map = h->fl_bitmap & (~0UL << (fl + 1));
+    if (fl_map == 0) {
+      return NULL;
+    }
+    fl = __builtin_ctzl(fl_map);
+    sl_map = h->sl_bitmap[fl];
+  }
+#ifdef HUGEPAGES
+  return huge_pick(h->bins[fl][__builtin_ctz(sl_map)], units, 1);
+#else
+  return h->bins[fl][__builtin_ctz(sl_map)];
+#endif
+}
+
+
+/* largest_block
+ * -------------
+ * A block of the highest non-empty list, the largest or close to it.
+ *
+ * h: heap to search
+ *
+ * return: the block, NULL if the heap has none
+ */
+static Header * largest_block(Heap * h) {
+  if (h->fl_bitmap == 0) {
+    return NULL;
+  }
+  unsigned fl = BITS_PER_WORD - 1 - __builtin_clzl(h->fl_bitmap);
+  return h->bins[fl][31 - __builtin_clz(h->sl_bitmap[fl])];
+}
+#else
+/* bin_index
+ * ---------
+ * Map a block size to its size class. Small sizes get an exact bin, larger
+ * sizes fall into one of SUB_BINS geometric bins per power of two. Sizes
+ * beyond the last class share the last bin.
+ *
+ * units: block size in header-sized units
+ *
+ * return: index into the bins of a heap
  */
-void coalescing_blocks(Header * toAdd, Header * block, Header ** fl) {
-  if (toAdd + toAdd->size == block->next) { // upper coalescing
-    toAdd->size += block->next->size;
-    toAdd->next = block->next->next;
+static inline unsigned bin_index(size_t units) {
+  if (units < NUM_EXACT_BINS) {
+    return units;
+  }
+  unsigned lg = BITS_PER_WORD - 1 - __builtin_clzl(units);
+  unsigned idx = NUM_EXACT_BINS + ((lg - EXACT_BIN_BITS) << SUB_BIN_BITS)
+    + ((units >> (lg - SUB_BIN_BITS)) & (SUB_BINS - 1));
+  return idx < NUM_BINS ? idx : NUM_BINS - 1;
+}
+
+
+/* bin_insert
+ * ----------
+ * Add a free block to the bin of its size class and mark the bin as
+ * non-empty. Exact bins are lists, the block is pushed on the front.
+ * Geometric bins are trees ordered by size and address.
+ *
+ * h: heap owning the bins
+ * block: free block with a valid size
+ */
+static inline void bin_insert(Heap * h, Header * block) {
+  unsigned idx = bin_index(block->size);
+  if (idx >= NUM_EXACT_BINS) {
+    tree_insert(&h->bins[idx], block);
   }
   else {
-    toAdd->next = block->next;
+    list_push(&h->bins[idx], block);
   }
-  if (toAdd == block + block->size) { // lower coalescing
-    block->size += toAdd->size;
-    block->next = toAdd->next;
+  h->free_units += block->size;
+  h->binmap[idx / BITS_PER_WORD] |= 1UL << (idx % BITS_PER_WORD);
+#ifdef SCAVENGER
+  if (DECAYING(block)) {
+    decay_push(h, block);
+  }
+#endif
+}
+
+
+/* bin_remove
+ * ----------
+ * Unlink a free block from its bin. Must be called before the size of the
+ * block changes.
+ *
+ * h: heap owning the bins
+ * block: free block currently in a bin
+ */
+static inline void bin_remove(Heap * h, Header * block) {
+  unsigned idx = bin_index(block->size);
+  if (idx >= NUM_EXACT_BINS) {
+    tree_remove(&h->bins[idx], block);
   }
   else {
-    block->next = toAdd;
+    list_remove(&h->bins[idx], block);
+  }
+  h->free_units -= block->size;
+#ifdef SCAVENGER
+  if (DECAYING(block)) {
+    decay_remove(h, block);
+  }
+#endif
+  if (h->bins[idx] == NULL) {
+    h->binmap[idx / BITS_PER_WORD] &= ~(1UL << (idx % BITS_PER_WORD));
   }
-  *fl = block;
 }
 
 
-/* ts_malloc_nolock
- * -----------------
- * Allocate memory with n bytes without using lock to achieve thread-safe malloc
- * 
- * n: in bytes of requested memory
+/* next_bin
+ * --------
+ * Use the bitmap to find the first non-empty bin at or above idx.
+ *
+ * h: heap to search
+ * idx: smallest acceptable bin index
+ *
+ * return: index of the bin, NUM_BINS if there is none
  */
-void * ts_malloc_nolock(size_t n) { 
-  my_malloc(n, &tls_free_list, 0);
+static inline unsigned next_bin(Heap * h, unsigned idx) {
+  unsigned w = idx / BITS_PER_WORD;
+  if (w >= BINMAP_WORDS) {
+    return NUM_BINS;
+  }
+  unsigned long bits = h->binmap[w] & (~0UL << (idx % BITS_PER_WORD));
+  while (bits == 0) {
+    if (++w == BINMAP_WORDS) {
+      return NUM_BINS;
+    }
+    bits = h->binmap[w];
+  }
+  return w * BITS_PER_WORD + __builtin_ctzl(bits);
 }
 
 
-/* ts_free_nolock
- * -----------------
- * Return the memory from user to the free list in a lock-free thread safe way
- * 
- * ptr: pointer to memory to return to free list
+/* tree_less
+ * ---------
+ * Order of blocks in a tree bin: by size, equal sizes by address.
  */
-void ts_free_nolock(void * ptr) {
-  insert_free_list(ptr, &tls_free_list);
+static inline int tree_less(Header * a, Header * b) {
+  return a->size < b->size || (a->size == b->size && a < b);
 }
 
 
-/* initialize_alloc
- * ----------------
- * First time malloc setup. Setup the arena using a base header. Make TLS or
- * Lock version based on need_lock
- * 
- * prev: double pointer to prev node of current node
- * need_lock: indicate use of lock or not
- * fl: double pointer to list entry node
+/* tree_is_red
+ * -----------
+ * Color of a tree node, missing children count as black.
  */
-void initialize_alloc(Header ** prev, int need_lock, Header ** fl) {
-  if (need_lock) {
-    *prev = *fl = &base;
-    base.size = 0;
-    base.next = *fl;
-    base.tid = pthread_self();
+static inline int tree_is_red(Header * node) {
+  return node != NULL && TREE(node)->red;
+}
+
+
+/* tree_replace
+ * ------------
+ * Make new take the place of old below old's parent.
+ *
+ * root: root of the tree
+ * old: node being replaced
+ * new: replacement, may be NULL
+ */
+static inline void tree_replace(Header ** root, Header * old, Header * new) {
+  Header * parent = TREE(old)->parent;
+  if (parent == NULL) {
+    *root = new;
+  }
+  else if (TREE(parent)->left == old) {
+    TREE(parent)->left = new;
   }
   else {
-    *prev = *fl = &tls_base;
-    tls_base.size = 0;
-    tls_base.next = *fl;
-    tls_base.tid = pthread_self();
+    TREE(parent)->right = new;
+  }
+  if (new) {
+    TREE(new)->parent = parent;
   }
 }
 
 
-/* my_malloc
+/* tree_rotate
+ * -----------
+ * Rotate the subtree at node to the left (its right child moves up) or to
+ * the right (its left child moves up).
+ *
+ * root: root of the tree
+ * node: top of the subtree
+ * left: direction of the rotation
+ */
+static void tree_rotate(Header ** root, Header * node, int left) {
+  Header * up = left ? TREE(node)->right : TREE(node)->left;
+  Header * mid = left ? TREE(up)->left : TREE(up)->right;
+  tree_replace(root, node, up);
+  if (left) {
+    TREE(node)->right = mid;
+    TREE(up)->left = node;
+  }
+  else {
+    TREE(node)->left = mid;
+    TREE(up)->right = node;
+  }
+  if (mid) {
+    TREE(mid)->parent = node;
+  }
+  TREE(node)->parent = up;
+}
+
+
+/* tree_insert
+ * -----------
+ * Insert a free block into a red-black tree bin and rebalance.
+ *
+ * root: root of the tree
+ * block: free block with a valid size
+ */
+static void tree_insert(Header ** root, Header * block) {
+  Header * parent = NULL, ** link = root;
+  while (*link) {
+    parent = *link;
+    link = tree_less(block, parent) ? &TREE(parent)->left : &TREE(parent)->right;
+  }
+  TREE(block)->left = TREE(block)->right = NULL;
+  TREE(block)->parent = parent;
+  TREE(block)->red = 1;
+  *link = block;
+  while (tree_is_red(parent = TREE(block)->parent)) {
+    Header * grand = TREE(parent)->parent; // a red node is never the root
+    int left = parent == TREE(grand)->left;
+    Header * uncle = left ? TREE(grand)->right : TREE(grand)->left;
+    if (tree_is_red(uncle)) {
+      TREE(parent)->red = TREE(uncle)->red = 0;
+      TREE(grand)->red = 1;
+      block = grand;
+      continue;
+    }
+    if (block == (left ? TREE(parent)->right : TREE(parent)->left)) {
+      tree_rotate(root, parent, left);
+      block = parent;
+      parent = TREE(block)->parent;
+    }
+    TREE(parent)->red = 0;
+    TREE(grand)->red = 1;
+    tree_rotate(root, grand, !left);
+  }
+  TREE(*root)->red = 0;
+}
+
+
+/* tree_remove
+ * -----------
+ * Unlink a free block from a red-black tree bin and rebalance. A block
+ * with two children is swapped with its in-order successor first.
+ *
+ * root: root of the tree
+ * block: free block currently in the tree
+ */
+static void tree_remove(Header ** root, Header * block) {
+  Header * child, * parent;
+  size_t red = TREE(block)->red;
+  if (TREE(block)->left == NULL || TREE(block)->right == NULL) {
+    child = TREE(block)->left ? TREE(block)->left : TREE(block)->right;
+    parent = TREE(block)->parent;
+    tree_replace(root, block, child);
+  }
+  else {
+    Header * succ = TREE(block)->right;
+    while (TREE(succ)->left) {
+      succ = TREE(succ)->left;
+    }
+    child = TREE(succ)->right;
+    red = TREE(succ)->red;
+    if (TREE(succ)->parent == block) {
+      parent = succ;
+    }
+    else {
+      parent = TREE(succ)->parent;
+      tree_replace(root, succ, child);
+      TREE(succ)->right = TREE(block)->right;
+      TREE(TREE(succ)->right)->parent = succ;
+    }
+    tree_replace(root, block, succ);
+    TREE(succ)->left = TREE(block)->left;
+    TREE(TREE(succ)->left)->parent = succ;
+    TREE(succ)->red = TREE(block)->red;
+  }
+  if (red) {
+    return;
+  }
+  while (child != *root && !tree_is_red(child)) { // child carries extra black
+    int left = child == TREE(parent)->left;
+    Header * sib = left ? TREE(parent)->right : TREE(parent)->left;
+    if (tree_is_red(sib)) {
+      TREE(sib)->red = 0;
+      TREE(parent)->red = 1;
+      tree_rotate(root, parent, left);
+      sib = left ? TREE(parent)->right : TREE(parent)->left;
+    }
+    Header * near = left ? TREE(sib)->left : TREE(sib)->right;
+    Header * far = left ? TREE(sib)->right : TREE(sib)->left;
+    if (!tree_is_red(near) && !tree_is_red(far)) {
+      TREE(sib)->red = 1;
+      child = parent;
+      parent = TREE(parent)->parent;
+      continue;
+    }
+    if (!tree_is_red(far)) {
+      TREE(near)->red = 0;
+      TREE(sib)->red = 1;
+      tree_rotate(root, sib, !left);
+      sib = left ? TREE(parent)->right : TREE(parent)->left;
+      far = left ? TREE(sib)->right : TREE(sib)->left;
+    }
+    TREE(sib)->red = TREE(parent)->red;
+    TREE(parent)->red = 0;
+    TREE(far)->red = 0;
+    tree_rotate(root, parent, left);
+    child = *root;
+  }
+  if (child) {
+    TREE(child)->red = 0;
+  }
+}
+
+
+/* tree_search
+ * -----------
+ * Best fit search in a tree bin: the smallest block of at least units,
+ * the lowest address among blocks of that size.
+ *
+ * root: root of the tree
+ * units: requested size in header-sized units
+ *
+ * return: the best fitting block, NULL if none fits
+ */
+static Header * tree_search(Header * root, size_t units) {
+  Header * best = NULL;
+  while (root) {
+    if (root->size >= units) {
+      best = root;
+      root = TREE(root)->left;
+    }
+    else {
+      root = TREE(root)->right;
+    }
+  }
+  return best;
+}
+
+
+#ifdef HUGEPAGES
+/* tree_next
  * ---------
- * The actual memory allocator main logic. Search the free list for suitable
- * block and return a chopped block if found. Ask OS for more heap if no such
- * block found. If need lock, the acquire/free lock operations will be on.
- * 
- * n: size in bytes of requested memo
- * fl: double pointer to the entry node of the list
- * need_lock: indicate use of lock or not
- * 
- * return: pointer to the allocated memory
+ * In-order successor of a tree node: the next larger size, or the same
+ * size at the next higher address.
+ *
+ * node: node of a tree bin
+ *
+ * return: the successor, NULL if node is the last one
  */
-void * my_malloc(size_t n, Header ** fl, int need_lock) {
-  if (need_lock) {
-    pthread_mutex_lock(&free_list_mutex); // lock access to free list 
+static Header * tree_next(Header * node) {
+  if (TREE(node)->right) {
+    node = TREE(node)->right;
+    while (TREE(node)->left) {
+      node = TREE(node)->left;
+    }
+    return node;
   }
-  size_t sunits = (n + sizeof(Header) - 1) / sizeof(Header) + 1;
-  Header * curr = NULL, * prev = *fl;
-  unsigned mindiff = UINT_MAX;
-  if (prev == NULL) {
-    initialize_alloc(&prev, need_lock, fl);
-  }
-  curr = prev->next;
-  Header * best = NULL, * bestPrev = NULL;
-  while (1) {
-    if (curr->size >= sunits) {
-      if (curr->size == sunits) {
-        prev->next = curr->next;
-        *fl = prev;
-        if (need_lock) {
-          pthread_mutex_unlock(&free_list_mutex); // success unlock
-        }
-        return (void *)(curr + 1);
-      }
-      else if (curr->size - sunits < mindiff) {
-        mindiff = curr->size - sunits;
-        best = curr;
-        bestPrev = prev;
-      }
+  Header * parent;
+  while ((parent = TREE(node)->parent) && TREE(parent)->right == node) {
+    node = parent;
+  }
+  return parent;
+}
+#endif
+
+
+/* find_block
+ * ----------
+ * Find the best fitting free block. An exact bin holds blocks of the
+ * requested size only. A tree bin may hold blocks that are too small, so
+ * it is searched for the smallest one that fits. Otherwise the smallest
+ * block of the next non-empty bin is the best fit. With HUGEPAGES it is
+ * compared with the next few blocks of its bin for the fullest hugepage.
+ *
+ * h: heap to search
+ * units: requested size in header-sized units
+ *
+ * return: block to allocate from, NULL if the heap has none
+ */
+static Header * find_block(Heap * h, size_t units) {
+  unsigned idx = bin_index(units);
+  Header * best = NULL;
+  if (h->bins[idx]) {
+    best = idx < NUM_EXACT_BINS ? h->bins[idx] : tree_search(h->bins[idx], units);
+  }
+  if (best == NULL) {
+    idx = next_bin(h, idx + 1);
+    if (idx == NUM_BINS) {
+      return NULL;
     }
-    if (curr == *fl) { // done one iteration
-      if (best) {
-        *fl = bestPrev;
-        void * res = processBlock(best, sunits); 
-        if (need_lock) {
-          pthread_mutex_unlock(&free_list_mutex); // success unlock
-        }
-        return res;
-      }
-      else {
-        if ((curr = malloc_sys(sunits, fl, need_lock)) == NULL) {
-          if (need_lock) {
-            pthread_mutex_unlock(&free_list_mutex);
-          }
-          return NULL;
-        }
+    best = idx < NUM_EXACT_BINS ? h->bins[idx] : tree_search(h->bins[idx], 0);
+  }
+#ifdef HUGEPAGES
+  best = huge_pick(best, units, idx < NUM_EXACT_BINS);
+#endif
+  return best;
+}
+
+
+/* largest_block
+ * -------------
+ * The largest free block: the rightmost node of the highest non-empty
+ * bin, or the head of an exact bin.
+ *
+ * h: heap to search
+ *
+ * return: the block, NULL if the heap has none
+ */
+static Header * largest_block(Heap * h) {
+  for (unsigned w = BINMAP_WORDS; w-- > 0;) {
+    if (h->binmap[w]) {
+      unsigned idx = w * BITS_PER_WORD + BITS_PER_WORD - 1 - __builtin_clzl(h->binmap[w]);
+      Header * block = h->bins[idx];
+      while (idx >= NUM_EXACT_BINS && TREE(block)->right) {
+        block = TREE(block)->right;
       }
+      return block;
     }
-    prev = curr;
-    curr = curr->next;
   }
-}
\ No newline at end of file
+  return NULL;
+}
+
+
+#endif
+
+
+/* processBlock
+ * -------------
+ * allocate from a suitable sized block by chopping memory of size 'size'
+ * and update related Header data. The remain of the block is moved to the
+ * bin of its new size. A block whose remain would be too small to hold the
+ * free links is handed out as a whole.
+ *
+ * h: heap owning the block
+ * start: the header of block to be chopped allocated
+ * size: size of memory in request
+ *
+ * return: the pointer to the memory following the chopped out block
+ */
+void * processBlock(Heap * h, Header * start, size_t size) {
+  Header * block = start;
+  if (start->size - size >= MIN_UNITS) {
+    block += start->size - size;
+  }
+  return (void *)(carve_block(h, start, block, size) + 1);
+}
+
+
+/* carve_block
+ * -----------
+ * Allocate units starting at start out of the free block 'block'. The
+ * pieces before and after go back to the bins, a piece after that is too
+ * small to be a block stays part of the allocation. The piece before must
+ * be empty or at least MIN_UNITS.
+ *
+ * h: heap owning the block
+ * block: free block
+ * start: first unit to allocate, inside block
+ * units: number of units to allocate
+ *
+ * return: header of the allocated block
+ */
+Header * carve_block(Heap * h, Header * block, Header * start, size_t units) {
+  size_t head = start - block, total = block->size;
+  bin_remove(h, block);
+  if (head) {
+    block->size = head;
+    FOOTER(block) = head;
+    bin_insert(h, block);
+    start->flags = 0;
+  }
+  if (total - head - units >= MIN_UNITS) {
+    Header * rest = start + units;
+    rest->size = total - head - units;
+    rest->flags = PINUSE;
+    FOOTER(rest) = rest->size;
+    bin_insert(h, rest);
+  }
+  else {
+    units = total - head;
+    (start + units)->flags |= PINUSE;
+  }
+  start->size = units;
+  start->flags |= CINUSE;
+  start->heap = h;
+#ifdef HUGEPAGES
+  huge_account(start, 1);
+#endif
+  return start;
+}
+
+
+/* malloc_sys
+ * -------------
+ * malloc uses this function to ask OS for more space when neither the
+ * free lists nor the top of the heap can serve a request. Every heap
+ * takes address space in regions that are mapped inaccessible (see
+ * region_reserve), REGION_MIN bytes at first and twice as many with every
+ * new region up to REGION_SIZE, and commits it page by page as it grows,
+ * so heaps grow independently of each other and of the program break,
+ * without a global lock. The minimum request amount starts at
+ * MIN_ALLOC and doubles with every growth up to MAX_ALLOC, so the number
+ * of calls into the OS grows only logarithmically with the heap at first.
+ * The new space ends with a fence header that is always in use, so
+ * coalescing never runs past it.
+ * While the region has room, the top is extended in place: only the units
+ * it is short of are committed and the old fence becomes part of the top.
+ * Otherwise a new region is reserved, its space becomes the top and what
+ * is left of the old top goes to the free lists. Before any of this a
+ * chunk of the depot that holds num_units becomes the top the same way.
+ *
+ * num_units: number of header-sized units the top must hold
+ * h: heap to add the new space to, locked
+ *
+ * return: the new top, NULL if OS refuses
+ */
+Header * malloc_sys(size_t num_units, Heap * h) {
+  if (num_units > (PTRDIFF_MAX - REGION_SIZE) / sizeof(Header)) {
+    return NULL;
+  }
+#ifdef SCAVENGER
+  pthread_once(&scavenger_once, scavenger_start);
+#endif
+  Header * chunk = depot_take(h, num_units);
+  if (chunk) {
+    if (h->top && h->top->size) {
+#ifdef HUGEPAGES
+      huge_account(h->top, 1);
+#endif
+      insert_free_list((void *)(h->top + 1), h);
+    }
+    h->top = chunk;
+    return chunk;
+  }
+  Header * fence = h->fence;
+  size_t units = num_units;
+  if (fence && h->top + h->top->size == fence && units > h->top->size) {
+    units -= h->top->size; // shortfall of a top that can be extended
+  }
+  size_t grow = h->grow ? h->grow : MIN_ALLOC;
+  if (units < grow / sizeof(Header)) {
+    units = grow / sizeof(Header);
+  }
+  Header * header = fence; // the old fence heads the extension
+  char * start = h->commit, * end, * limit = h->reserve;
+  if (fence && (char *)(fence + units + 1) <= h->reserve) {
+    end = (char *)ALIGN_UP(fence + units + 1, COMMIT_UNIT);
+  }
+  else {
+    size_t size = ALIGN_UP((units + 1) * sizeof(Header), COMMIT_UNIT);
+    size_t region = h->region ? h->region : REGION_MIN;
+    size_t reserve = size > region ? size : region;
+    if ((start = region_reserve(reserve)) == NULL) {
+      return NULL;
+    }
+    h->region = region < REGION_SIZE / 2 ? region * 2 : REGION_SIZE;
+    end = start + size;
+    limit = start + reserve;
+    header = NULL;
+  }
+#ifdef HUGEPAGES
+  if (hugemap_grow(start, end) < 0) {
+    if (header == NULL) {
+      munmap(start, limit - start);
+    }
+    return NULL;
+  }
+#endif
+  if (mprotect(start, end - start, PROT_READ | PROT_WRITE) != 0) {
+    if (header == NULL) {
+      munmap(start, limit - start);
+    }
+    return NULL;
+  }
+  if (header == NULL) { // new region
+    header = (Header *)start;
+    header->flags = PINUSE;
+  }
+  __atomic_add_fetch(&footprint, end - start, __ATOMIC_RELAXED);
+  units = (Header *)end - header - 1; // all of the committed pages
+  header->size = units;
+  header->flags |= CINUSE;
+  header->heap = h;
+  fence = header + units;
+  fence->size = 0;
+  fence->flags = CINUSE;
+  fence->heap = h;
+  h->commit = end;
+  h->reserve = limit;
+  h->fence = fence;
+  h->grow = grow < MAX_ALLOC / 2 ? grow * 2 : MAX_ALLOC;
+  if (h->top == header) { // empty top extended in place
+  }
+  else if (h->top && h->top + h->top->size == header) { // extended in place
+    h->top->size += units;
+  }
+  else {
+    if (h->top && h->top->size) { // never smaller than MIN_UNITS
+#ifdef HUGEPAGES
+      huge_account(h->top, 1); // the top is not counted, its blocks are
+#endif
+      insert_free_list((void *)(h->top + 1), h);
+    }
+    h->top = header;
+  }
+  return h->top;
+}
+
+
+/* region_reserve
+ * --------------
+ * Hand out inaccessible address space for a region. Regions are bumped
+ * off the current space with a single atomic add, only a thread that
+ * finds the space used up takes space_lock to reserve the next one.
+ * Regions larger than REGION_SIZE, and all regions once no more spaces
+ * can be reserved, are reserved on their own.
+ *
+ * size: bytes, a multiple of COMMIT_UNIT
+ *
+ * return: start of the region, NULL if OS refuses
+ */
+static char * region_reserve(size_t size) {
+  if (size > REGION_SIZE) {
+    return map_pages(size, PROT_NONE, MAP_NORESERVE);
+  }
+  for (;;) {
+    unsigned long word = __atomic_load_n(&space_word, __ATOMIC_RELAXED);
+    if ((word & SPACE_MASK) + size <= SPACE_SIZE) { // else do not add to a used up space
+      word = __atomic_fetch_add(&space_word, size, __ATOMIC_ACQUIRE);
+      size_t used = word & SPACE_MASK;
+      if (used + size <= SPACE_SIZE) {
+        return __atomic_load_n(&spaces[word >> SPACE_SHIFT], __ATOMIC_ACQUIRE) + used;
+      }
+    }
+    if (space_grow(size) < 0) {
+      return map_pages(size, PROT_NONE, MAP_NORESERVE);
+    }
+  }
+}
+
+
+/* space_grow
+ * ----------
+ * Slow path of region_reserve: reserve the next space unless another
+ * thread already did. The space is published before the bump word moves
+ * to its index, so no add can see the index without the space. Adds that
+ * failed on the used up space are lost when the bump word is reset, they
+ * never returned a region.
+ *
+ * size: bytes wanted
+ *
+ * return: 0 to retry, -1 if no more space can be reserved
+ */
+static int space_grow(size_t size) {
+  int res = 0;
+  lock_acquire(&space_lock);
+  unsigned long cur = __atomic_load_n(&space_word, __ATOMIC_RELAXED);
+  unsigned idx = cur >> SPACE_SHIFT;
+  if ((cur & SPACE_MASK) + size > SPACE_SIZE) {
+    idx++;
+    char * base = NULL;
+    if (idx < MAX_SPACES) {
+      base = map_pages(SPACE_SIZE, PROT_NONE, MAP_NORESERVE);
+    }
+    if (base == NULL) {
+      res = -1;
+    }
+    else {
+      __atomic_store_n(&spaces[idx], base, __ATOMIC_RELEASE);
+      __atomic_store_n(&space_word, (unsigned long)idx << SPACE_SHIFT, __ATOMIC_RELEASE);
+    }
+  }
+  lock_release(&space_lock);
+  return res;
+}
+
+
+/* map_pages
+ * ---------
+ * Map anonymous memory. With HUGEPAGES a mapping of a hugepage and more
+ * starts on a hugepage boundary, so that all of its whole hugepages can be
+ * backed by transparent hugepages, and it is advised to be. The excess of
+ * the larger mapping this takes is unmapped again.
+ *
+ * size: bytes, a multiple of the page size
+ * prot: protection of the mapping
+ * flags: flags besides MAP_PRIVATE | MAP_ANONYMOUS
+ *
+ * return: start of the mapping, NULL if OS refuses
+ */
+static char * map_pages(size_t size, int prot, int flags) {
+  flags |= MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef HUGEPAGES
+  if (size >= HUGE_PAGE_SIZE) {
+    if (size > SIZE_MAX - HUGE_PAGE_SIZE) {
+      return NULL;
+    }
+    size_t map = size + HUGE_PAGE_SIZE - PAGE_SIZE;
+    char * ptr = mmap(NULL, map, prot, flags, -1, 0);
+    if (ptr == MAP_FAILED) {
+      return NULL;
+    }
+    char * start = (char *)ALIGN_UP(ptr, HUGE_PAGE_SIZE);
+    if (start != ptr) {
+      munmap(ptr, start - ptr);
+    }
+    if (start + size != ptr + map) {
+      munmap(start + size, ptr + map - (start + size));
+    }
+    madvise(start, size, MADV_HUGEPAGE);
+    return start;
+  }
+#endif
+  void * ptr = mmap(NULL, size, prot, flags, -1, 0);
+  return ptr == MAP_FAILED ? NULL : (char *)ptr;
+}
+
+
+/* top_alloc
+ * ---------
+ * Bump a block off the top of the heap, the untouched end of the newest
+ * chunk. The top carries an in-use header, a block freed next to it
+ * becomes part of it (see coalescing_blocks). A remain too small to be a
+ * block is handed out as well, which leaves the fence as an empty top.
+ *
+ * h: heap owning the top
+ * units: number of units to allocate
+ *
+ * return: the allocated block, NULL if the top is too small
+ */
+Header * top_alloc(Heap * h, size_t units) {
+  Header * block = h->top;
+  if (block == NULL || block->size < units) {
+    return NULL;
+  }
+  if (block->size - units < MIN_UNITS) {
+    units = block->size;
+  }
+  Header * top = block + units;
+  if (units != block->size) {
+    top->size = block->size - units;
+    top->flags = CINUSE;
+    top->heap = h;
+  }
+  top->flags |= PINUSE;
+  block->size = units;
+  block->heap = h;
+  h->top = top;
+#ifdef HUGEPAGES
+  huge_account(block, 1);
+#endif
+  return block;
+}
+
+
+/* alloc_aligned
+ * -------------
+ * Allocate a block whose header sits on an 'align' boundary. A free block
+ * that already starts on one is used as is, otherwise a block with enough
+ * slack is searched for that the piece in front of the boundary can go
+ * back to the bins. Failing both the block is bumped off the top, so
+ * blocks allocated one after another from it need no slack at all.
+ *
+ * h: heap to allocate from
+ * units: size of the block in header-sized units
+ * align: alignment in bytes, a power of two
+ *
+ * return: the allocated block, NULL if OS refuses
+ */
+Header * alloc_aligned(Heap * h, size_t units, size_t align) {
+  Header * block = find_block(h, units);
+  if (block && ((uintptr_t)block & (align - 1)) == 0) {
+    return carve_block(h, block, block, units);
+  }
+  size_t slack = align / sizeof(Header) + MIN_UNITS;
+  if ((block = find_block(h, units + slack)) != NULL) {
+    char * start = (char *)ALIGN_UP(block, align);
+    if (start != (char *)block && (size_t)(start - (char *)block) < MIN_UNITS * sizeof(Header)) {
+      start += align;
+    }
+    return carve_block(h, block, (Header *)start, units);
+  }
+  for (;;) {
+    Header * top = h->top;
+    if (top) {
+      size_t head = (ALIGN_UP(top, align) - (uintptr_t)top) / sizeof(Header);
+      if (head && head < MIN_UNITS) {
+        head += align / sizeof(Header);
+      }
+      if (top->size >= head + units) {
+        Header * piece = head ? top_alloc(h, head) : NULL; // in front of the boundary
+        block = top_alloc(h, units);
+        if (piece) { // after the block, so it does not merge back into the top
+          insert_free_list((void *)(piece + 1), h);
+        }
+        return block;
+      }
+    }
+    if (malloc_sys(units + slack, h) == NULL) {
+      return NULL;
+    }
+  }
+}
+
+
+/* mmap_alloc
+ * ----------
+ * Map a large block on its own, outside of any heap, so that it goes back
+ * to the OS once it is freed. A cached mapping that fits is reused first.
+ * With HUGEPAGES a block that rounded up to whole hugepages wastes no
+ * more than the cache slack is given explicit hugepages if the system has
+ * any left, other blocks start on a hugepage boundary (see map_pages).
+ *
+ * n: size in bytes of requested memory
+ *
+ * return: pointer to the memory following the header, NULL if OS refuses
+ */
+void * mmap_alloc(size_t n) {
+  if (n > SIZE_MAX - sizeof(Header) - PAGE_SIZE) {
+    return NULL;
+  }
+  size_t bytes = ALIGN_UP(n + sizeof(Header), PAGE_SIZE);
+  Header * block = mmap_cache_get(bytes);
+#ifdef HUGEPAGES
+  size_t huge = ALIGN_UP(bytes, HUGE_PAGE_SIZE);
+  if (block == NULL && bytes >= HUGE_PAGE_SIZE && huge - bytes <= bytes / MMAP_CACHE_SLACK
+      && !__atomic_load_n(&hugetlb_failed, __ATOMIC_RELAXED)) {
+    block = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (block == MAP_FAILED) {
+      __atomic_store_n(&hugetlb_failed, 1, __ATOMIC_RELAXED);
+      block = NULL;
+    }
+    else {
+      block->size = huge / sizeof(Header);
+    }
+  }
+#endif
+  if (block == NULL) {
+    block = (Header *)map_pages(bytes, PROT_READ | PROT_WRITE, 0);
+    if (block == NULL) {
+      return NULL;
+    }
+    block->size = bytes / sizeof(Header);
+  }
+  block->flags = PINUSE | CINUSE;
+  block->heap = NULL; // marks the block as mmapped
+  return (void *)(block + 1);
+}
+
+
+/* mmap_free
+ * ---------
+ * Release a block of mmap_alloc to the mapping cache, or unmap it if the
+ * cache does not take it. Needs no heap lock as no heap is involved.
+ *
+ * block: header of the block
+ */
+void mmap_free(Header * block) {
+  if (mmap_cache_put(block) < 0) {
+    munmap((void *)block, block->size * sizeof(Header));
+  }
+}
+
+
+/* now_ms
+ * ------
+ * Coarse monotonic clock for aging.
+ *
+ * return: time in milliseconds
+ */
+static unsigned long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+
+/* mmap_cache_get
+ * --------------
+ * Take the smallest cached mapping that holds bytes and wastes no more
+ * than a 1/MMAP_CACHE_SLACK of them. Mappings older than MMAP_CACHE_AGE
+ * are dropped first, so none is handed out or kept past its age.
+ *
+ * bytes: page-rounded size of the mapping wanted
+ *
+ * return: header of the mapping, NULL if none fits
+ */
+static Header * mmap_cache_get(size_t bytes) {
+  if (__atomic_load_n(&mmap_cache_bytes, __ATOMIC_RELAXED) == 0) { // a racy miss costs an mmap
+    return NULL;
+  }
+  Header * drop[MMAP_CACHE_SLOTS];
+  unsigned long now = now_ms();
+  lock_acquire(&mmap_cache_lock);
+  unsigned ndrop = mmap_cache_expire(now, drop);
+  CachedMap * best = NULL;
+  for (CachedMap * c = mmap_cache; c < mmap_cache + MMAP_CACHE_SLOTS; c++) {
+    size_t size = c->block ? c->block->size * sizeof(Header) : 0;
+    if (size >= bytes && size - bytes <= bytes / MMAP_CACHE_SLACK
+        && (best == NULL || size < best->block->size * sizeof(Header))) {
+      best = c;
+    }
+  }
+  Header * block = NULL;
+  if (best) {
+    block = best->block;
+    best->block = NULL;
+    mmap_cache_bytes -= block->size * sizeof(Header);
+  }
+  lock_release(&mmap_cache_lock);
+  mmap_cache_unmap(drop, ndrop);
+  return block;
+}
+
+
+/* mmap_cache_put
+ * --------------
+ * Keep a freed mapping for reuse. Mappings older than MMAP_CACHE_AGE are
+ * dropped first, then the oldest ones until the new one fits in the slots
+ * and the byte budget. Dropped mappings are unmapped outside of the lock.
+ * With SCAVENGER the scavenger is started to drop them in time.
+ *
+ * block: header of the mapping
+ *
+ * return: 0 if cached, -1 if the mapping is too large to be cached
+ */
+static int mmap_cache_put(Header * block) {
+  size_t bytes = block->size * sizeof(Header);
+  if (bytes > MMAP_CACHE_BYTES) {
+    return -1;
+  }
+#ifdef SCAVENGER
+  pthread_once(&scavenger_once, scavenger_start); // it ages the cache
+#endif
+  Header * drop[MMAP_CACHE_SLOTS];
+  unsigned long now = now_ms();
+  lock_acquire(&mmap_cache_lock);
+  unsigned ndrop = mmap_cache_expire(now, drop);
+  CachedMap * slot = NULL;
+  for (;;) {
+    CachedMap * oldest = NULL;
+    for (CachedMap * c = mmap_cache; c < mmap_cache + MMAP_CACHE_SLOTS; c++) {
+      if (c->block == NULL) {
+        slot = c;
+      }
+      else if (oldest == NULL || c->stamp < oldest->stamp) {
+        oldest = c;
+      }
+    }
+    if (slot && mmap_cache_bytes + bytes <= MMAP_CACHE_BYTES) {
+      break;
+    }
+    drop[ndrop++] = oldest->block; // over budget or out of slots
+    mmap_cache_bytes -= oldest->block->size * sizeof(Header);
+    oldest->block = NULL;
+  }
+  slot->block = block;
+  slot->stamp = now;
+  mmap_cache_bytes += bytes;
+  lock_release(&mmap_cache_lock);
+  mmap_cache_unmap(drop, ndrop);
+  return 0;
+}
+
+
+/* mmap_cache_expire
+ * -----------------
+ * Take the mappings older than MMAP_CACHE_AGE out of the cache.
+ *
+ * now: time in milliseconds, see now_ms
+ * drop: room for MMAP_CACHE_SLOTS mappings to unmap, filled in
+ *
+ * return: number of mappings taken out
+ */
+static unsigned mmap_cache_expire(unsigned long now, Header ** drop) {
+  unsigned ndrop = 0;
+  for (CachedMap * c = mmap_cache; c < mmap_cache + MMAP_CACHE_SLOTS; c++) {
+    if (c->block && now - c->stamp > MMAP_CACHE_AGE) {
+      drop[ndrop++] = c->block;
+      mmap_cache_bytes -= c->block->size * sizeof(Header);
+      c->block = NULL;
+    }
+  }
+  return ndrop;
+}
+
+
+/* mmap_cache_unmap
+ * ----------------
+ * Unmap mappings taken out of the cache, with mmap_cache_lock dropped.
+ *
+ * drop: mappings to unmap
+ * ndrop: number of mappings
+ */
+static void mmap_cache_unmap(Header ** drop, unsigned ndrop) {
+  while (ndrop) {
+    Header * victim = drop[--ndrop];
+    munmap((void *)victim, victim->size * sizeof(Header));
+  }
+}
+
+
+#ifdef SCAVENGER
+/* mmap_cache_trim
+ * ---------------
+ * Unmap the cached mappings past their age, for the scavenger, so the
+ * cache empties even when no large block is freed or allocated anymore.
+ */
+static void mmap_cache_trim(void) {
+  if (__atomic_load_n(&mmap_cache_bytes, __ATOMIC_RELAXED) == 0) {
+    return;
+  }
+  Header * drop[MMAP_CACHE_SLOTS];
+  unsigned long now = now_ms();
+  lock_acquire(&mmap_cache_lock);
+  unsigned ndrop = mmap_cache_expire(now, drop);
+  lock_release(&mmap_cache_lock);
+  mmap_cache_unmap(drop, ndrop);
+}
+#endif
+
+
+/* ts_free_lock
+ * ------------
+ * Public thread-safe free operation for external free call.
+ * Thread safety is achieved by locking the arena owning the block,
+ * at the lock of its class for a small object.
+ *
+ * ptr: space to be free and inserted into free list
+ */
+void ts_free_lock(void * ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  Span * span = pagemap_get(ptr);
+  if (span == NULL && IS_MMAPPED((Header *)ptr - 1)) {
+    mmap_free((Header *)ptr - 1);
+    return;
+  }
+  if (span && tcache_start() == 0) { // cached, the oldest flushed when full
+#ifdef PERCPU
+    if (tcache.state == 2) {
+      if (percpu_push(span->cls, ptr) || (percpu_flush(span->cls) && percpu_push(span->cls, ptr))) {
+        return;
+      }
+      Lock * lock = class_lock(span->heap, span->cls); // no stack for this CPU
+      lock_acquire(lock);
+      slab_free(span->heap, span, ptr, 1);
+      lock_release(lock);
+      return;
+    }
+#endif
+    if (tcache.count[span->cls] == TCACHE_COUNT) {
+      tcache_flush(span->cls, TCACHE_BATCH);
+    }
+    tcache.objs[span->cls][tcache.count[span->cls]++] = ptr;
+    return;
+  }
+  if (span) {
+    Lock * lock = class_lock(span->heap, span->cls);
+    lock_acquire(lock);
+    slab_free(span->heap, span, ptr, 1);
+    lock_release(lock);
+    return;
+  }
+  Heap * h = ((Header *)ptr - 1)->heap;
+  heap_lock(h, 1); // locking free_list: insert & search again
+  insert_free_list(ptr, h);
+  heap_unlock(h, 1);
+}
+
+
+/* insert_free_list
+ * ----------------
+ * Take a pointer to a block of memory and insert it to the free list
+ * managed by my_malloc. The boundary tags locate the physical neighbours,
+ * so no list needs to be searched.
+ *
+ * ptr: pointer to the block of memory to insert
+ * h: heap owning the free lists
+ */
+void insert_free_list(void * ptr, Heap * h) {
+  Header * toAdd = (Header *)ptr - 1;
+  toAdd->flags &= ~CINUSE;
+#ifdef HUGEPAGES
+  huge_account(toAdd, 0);
+#endif
+  coalescing_blocks(toAdd, toAdd + toAdd->size, h);
+}
+
+
+/* coalescing_blocks
+ * -----------------
+ * While inserting block into the free list, coalescing with adjacent
+ * blocks if possible. The following block tells if it is in use by its
+ * flags, the preceding one by the PINUSE bit of toAdd and its size by its
+ * footer. A block that ends at the top becomes part of the top, which may
+ * then be trimmed. A block that is all of a chunk lent by another heap
+ * goes back to the depot. The pages of a large free block are released,
+ * or with SCAVENGER the scavenger releases them once decayed.
+ *
+ * toAdd: block to be inserted
+ * block: block physically following toAdd
+ * h: heap owning the free lists
+ */
+void coalescing_blocks(Header * toAdd, Header * block, Heap * h) {
+  if (!(block->flags & CINUSE)) { // upper coalescing
+    bin_remove(h, block);
+    toAdd->size += block->size;
+  }
+  if (!(toAdd->flags & PINUSE)) { // lower coalescing
+    Header * prev = toAdd - ((size_t *)toAdd)[-1];
+    bin_remove(h, prev);
+    prev->size += toAdd->size;
+    toAdd = prev;
+  }
+  if (toAdd + toAdd->size == h->top) { // merge into the top
+    toAdd->size += h->top->size;
+    toAdd->flags |= CINUSE;
+    h->top = toAdd;
+    heap_trim(h);
+    return;
+  }
+  Header * end = toAdd + toAdd->size;
+  if (end->size == 0 && end->heap == (Heap *)toAdd) {
+    depot_return(toAdd); // all of a chunk lent by another heap
+    return;
+  }
+  FOOTER(toAdd) = toAdd->size;
+  (toAdd + toAdd->size)->flags &= ~PINUSE;
+#ifndef SCAVENGER // else released by the scavenger once decayed
+  if (toAdd->size * sizeof(Header) >= RELEASE_THRESHOLD && RELEASED(toAdd) != toAdd->size) {
+    release_block(toAdd);
+  }
+#endif
+  bin_insert(h, toAdd);
+}
+
+
+/* heap_trim
+ * ---------
+ * Give the end of a large top back to the OS: its pages are released and
+ * made inaccessible again, so the region can commit them anew. Only the
+ * top of the newest region ends at committed memory that can be given
+ * back this way.
+ *
+ * h: heap owning the top
+ */
+static void heap_trim(Heap * h) {
+  Header * top = h->top;
+  if (top->size * sizeof(Header) < TRIM_THRESHOLD || top + top->size != h->fence) {
+    return;
+  }
+  char * end = (char *)ALIGN_UP((char *)(top + 1) + TOP_PAD, COMMIT_UNIT);
+  madvise(end, h->commit - end, MADV_DONTNEED);
+  mprotect(end, h->commit - end, PROT_NONE);
+  __atomic_sub_fetch(&footprint, h->commit - end, __ATOMIC_RELAXED);
+  h->commit = end;
+  top->size = (Header *)end - top - 1;
+  Header * fence = top + top->size;
+  fence->size = 0;
+  fence->flags = PINUSE | CINUSE;
+  fence->heap = h;
+  h->fence = fence;
+}
+
+
+/* depot_give
+ * ----------
+ * Give the largest free blocks of a thread heap to the depot until its
+ * bins hold no more than half of DEPOT_THRESHOLD, the depot is full or the
+ * largest block is too small to make a chunk of.
+ *
+ * h: thread heap, locked
+ */
+static void depot_give(Heap * h) {
+  while (h->free_units * sizeof(Header) > DEPOT_THRESHOLD / 2
+         && __atomic_load_n(&depot_bytes, __ATOMIC_RELAXED) < DEPOT_MAX) {
+    Header * block = largest_block(h);
+    if (block == NULL || depot_put(h, block) < 0) {
+      break;
+    }
+  }
+}
+
+
+/* depot_put
+ * ---------
+ * Cut a chunk out of a free block and add it to the depot. The chunk
+ * starts on a DEPOT_ALIGN boundary right after an in-use guard header that
+ * stays in the heap, and ends in an in-use fence before the next boundary,
+ * so with HUGEPAGES no hugepage is shared with the heap. Pieces in front
+ * of the guard and after the fence go back to the bins, each is empty or
+ * at least MIN_UNITS. The chunk itself is marked in use. The guard records
+ * h and the fence the start of the chunk in place of a heap, so the chunk
+ * is known once it is all free again (see depot_return).
+ *
+ * h: heap owning the block, locked
+ * block: free block in the bins
+ *
+ * return: 0 on success, -1 if the block is smaller than DEPOT_MIN or too
+ * small for a chunk
+ */
+static int depot_put(Heap * h, Header * block) {
+  size_t step = DEPOT_ALIGN / sizeof(Header);
+  Header * end = block + block->size;
+  Header * chunk = (Header *)ALIGN_UP(block + 1, DEPOT_ALIGN);
+  if (chunk - 1 != block && (size_t)(chunk - 1 - block) < MIN_UNITS) {
+    chunk += step;
+  }
+  Header * fence = (Header *)((uintptr_t)end & ~(uintptr_t)(DEPOT_ALIGN - 1)) - 1;
+  if (fence + 1 != end && (size_t)(end - fence - 1) < MIN_UNITS) {
+    fence -= step;
+  }
+  if (block->size * sizeof(Header) < DEPOT_MIN || fence < chunk + MIN_UNITS) {
+    return -1;
+  }
+  bin_remove(h, block);
+  Header * guard = chunk - 1;
+  size_t head = guard - block, tail = end - fence - 1;
+  if (head) {
+    block->size = head;
+    FOOTER(block) = head;
+    bin_insert(h, block);
+  }
+  guard->size = 0;
+  guard->flags = head ? CINUSE : PINUSE | CINUSE;
+  guard->heap = h;
+  chunk->size = fence - chunk;
+  chunk->flags = PINUSE | CINUSE;
+  chunk->heap = NULL;
+  fence->size = 0;
+  fence->flags = PINUSE | CINUSE;
+  fence->heap = (Heap *)chunk; // never a heap, see coalescing_blocks
+  if (tail) {
+    Header * rest = fence + 1;
+    rest->size = tail;
+    rest->flags = PINUSE;
+    FOOTER(rest) = tail;
+    bin_insert(h, rest);
+  }
+  else {
+    end->flags |= PINUSE;
+  }
+  depot_add(chunk);
+  return 0;
+}
+
+
+/* depot_cut
+ * ---------
+ * Give a block freed by another thread than its owner to the depot, where
+ * any heap can reuse it, instead of the remote stack of its owner. The
+ * block itself stays in use in the owner's heap, untouched but for its
+ * payload, so the owner may keep coalescing its neighbours meanwhile: the
+ * chunk is cut out of the payload, and its guard records how far before
+ * it the block starts, so the whole block is freed once the chunk comes
+ * back to the owner (see depot_merge).
+ *
+ * block: block of another heap, freed by the caller
+ *
+ * return: 0 on success, -1 if the block is smaller than DEPOT_MIN or too
+ * small for a chunk, or the depot is full
+ */
+static int depot_cut(Header * block) {
+  if (block->size * sizeof(Header) < DEPOT_MIN
+      || __atomic_load_n(&depot_bytes, __ATOMIC_RELAXED) >= DEPOT_MAX) {
+    return -1;
+  }
+  Header * chunk = (Header *)ALIGN_UP(block + 2, DEPOT_ALIGN);
+  Header * fence = (Header *)((uintptr_t)(block + block->size) & ~(uintptr_t)(DEPOT_ALIGN - 1)) - 1;
+  if (fence < chunk + MIN_UNITS) {
+    return -1;
+  }
+  Header * guard = chunk - 1;
+  guard->size = guard - block; // never 0, unlike the guard of depot_put
+  guard->flags = PINUSE | CINUSE;
+  guard->heap = block->heap;
+  chunk->size = fence - chunk;
+  chunk->flags = PINUSE | CINUSE;
+  chunk->heap = NULL;
+  fence->size = 0;
+  fence->flags = PINUSE | CINUSE;
+  fence->heap = (Heap *)chunk;
+#ifdef HUGEPAGES
+  huge_account(chunk, 0); // whole hugepages of the block, counted by no one else
+#endif
+  depot_add(chunk);
+  return 0;
+}
+
+
+/* depot_add
+ * ---------
+ * Release the pages of a chunk, decommit them like heap_trim does and add
+ * the chunk to the depot.
+ *
+ * chunk: chunk marked in use, between its guard and fence
+ */
+static void depot_add(Header * chunk) {
+  release_block(chunk);
+  depot_commit(chunk, 0);
+  lock_acquire(&depot_lock);
+  depot_insert(chunk);
+  lock_release(&depot_lock);
+}
+
+
+/* depot_return
+ * ------------
+ * Give a chunk lent to a heap back to the depot once all of it is free
+ * again, for the heap it was cut from to take back.
+ *
+ * chunk: free block spanning the chunk, in no bin
+ */
+static void depot_return(Header * chunk) {
+  chunk->flags |= CINUSE;
+  (chunk + chunk->size)->flags |= PINUSE;
+  depot_add(chunk);
+}
+
+
+/* depot_reclaim
+ * -------------
+ * Take the chunks cut from a heap back out of the depot and merge them
+ * into its free blocks. Only the chunks of the heap are looked at.
+ *
+ * h: heap, locked
+ *
+ * return: number of chunks taken back
+ */
+static int depot_reclaim(Heap * h) {
+  lock_acquire(&depot_lock);
+  Header * own = h->lent;
+  for (Header * chunk = own; chunk; chunk = LENT(chunk)->next) {
+    list_remove(&depot[depot_bin(chunk->size)], chunk);
+    depot_bytes -= chunk->size * sizeof(Header);
+  }
+  __atomic_store_n(&h->lent, NULL, __ATOMIC_RELAXED);
+  lock_release(&depot_lock);
+  int count = 0;
+  while (own) {
+    Header * next = LENT(own)->next;
+    if (depot_commit(own, 1) < 0) { // stays in the depot
+      lock_acquire(&depot_lock);
+      depot_insert(own);
+      lock_release(&depot_lock);
+    }
+    else {
+      depot_merge(h, own);
+      count++;
+    }
+    own = next;
+  }
+  return count;
+}
+
+
+/* depot_merge
+ * -----------
+ * Free a chunk of a heap together with its guard and fence, so it
+ * coalesces with the blocks around it as if it had never been cut. A
+ * chunk cut by depot_cut frees the whole block it was cut out of.
+ *
+ * h: heap the chunk was cut from, locked
+ * chunk: chunk taken out of the depot and committed
+ */
+static void depot_merge(Heap * h, Header * chunk) {
+  Header * guard = chunk - 1;
+  if (guard->size) {
+#ifdef HUGEPAGES
+    huge_account(chunk, 1); // the rest of the block is still counted
+#endif
+    insert_free_list((void *)(guard - guard->size + 1), h);
+    return;
+  }
+  guard->size = chunk->size + 2; // guard, chunk and fence
+  guard->flags |= CINUSE;
+  guard->heap = h;
+#ifdef HUGEPAGES
+  huge_account(guard, 1); // none of it is counted yet
+#endif
+  insert_free_list((void *)(guard + 1), h);
+}
+
+
+/* depot_take
+ * ----------
+ * Take a chunk of the depot that holds units and hand it to a heap. Only
+ * the first DEPOT_SCAN chunks of the bin of units are tried, every chunk
+ * of a larger bin fits, the smallest such bin is taken from. Its carved
+ * blocks then record that heap as their owner.
+ *
+ * h: heap about to grow, locked
+ * units: number of units the chunk must hold
+ *
+ * return: the chunk, NULL if none fits
+ */
+static Header * depot_take(Heap * h, size_t units) {
+  if (__atomic_load_n(&depot_bytes, __ATOMIC_RELAXED) == 0) { // a racy miss grows the heap
+    return NULL;
+  }
+  unsigned idx = depot_bin(units);
+  unsigned scan = DEPOT_SCAN;
+  Header * chunk = NULL;
+  lock_acquire(&depot_lock);
+  for (Header * next = depot[idx]; next && scan--; next = LINKS(next)->next) {
+    if (next->size >= units && (chunk == NULL || next->size < chunk->size)) {
+      chunk = next;
+    }
+  }
+  while (chunk == NULL && ++idx < DEPOT_BINS) {
+    scan = DEPOT_SCAN;
+    for (Header * next = depot[idx]; next && scan--; next = LINKS(next)->next) {
+      if (chunk == NULL || next->size < chunk->size) {
+        chunk = next;
+      }
+    }
+  }
+  if (chunk) {
+    depot_remove(chunk);
+  }
+  lock_release(&depot_lock);
+  if (chunk && depot_commit(chunk, 1) < 0) {
+    lock_acquire(&depot_lock);
+    depot_insert(chunk);
+    lock_release(&depot_lock);
+    return NULL;
+  }
+  if (chunk) {
+    chunk->heap = h;
+  }
+  return chunk;
+}
+
+
+/* depot_bin
+ * ---------
+ * Map a chunk size to its bin of the depot. A bin holds chunks of up to
+ * twice the size of the bin below, sizes beyond the last bin share it.
+ *
+ * units: chunk size in header-sized units
+ *
+ * return: index into the depot
+ */
+static inline unsigned depot_bin(size_t units) {
+  size_t min = DEPOT_MIN / sizeof(Header);
+  if (units < 2 * min) {
+    return 0;
+  }
+  unsigned idx = BITS_PER_WORD - 1 - __builtin_clzl(units / min);
+  return idx < DEPOT_BINS ? idx : DEPOT_BINS - 1;
+}
+
+
+/* depot_insert
+ * ------------
+ * Push a chunk on its bin of the depot and on the chunks of the heap it
+ * was cut from.
+ *
+ * chunk: chunk in no list, depot_lock held
+ */
+static void depot_insert(Header * chunk) {
+  Heap * h = (chunk - 1)->heap;
+  list_push(&depot[depot_bin(chunk->size)], chunk);
+  LENT(chunk)->prev = NULL;
+  LENT(chunk)->next = h->lent;
+  if (h->lent) {
+    LENT(h->lent)->prev = chunk;
+  }
+  __atomic_store_n(&h->lent, chunk, __ATOMIC_RELAXED);
+  depot_bytes += chunk->size * sizeof(Header);
+}
+
+
+/* depot_remove
+ * ------------
+ * Unlink a chunk from its bin of the depot and from the chunks of the
+ * heap it was cut from.
+ *
+ * chunk: chunk in the depot, depot_lock held
+ */
+static void depot_remove(Header * chunk) {
+  Heap * h = (chunk - 1)->heap;
+  Header * prev = LENT(chunk)->prev, * next = LENT(chunk)->next;
+  list_remove(&depot[depot_bin(chunk->size)], chunk);
+  if (prev) {
+    LENT(prev)->next = next;
+  }
+  else {
+    __atomic_store_n(&h->lent, next, __ATOMIC_RELAXED);
+  }
+  if (next) {
+    LENT(next)->prev = prev;
+  }
+  depot_bytes -= chunk->size * sizeof(Header);
+}
+
+
+/* depot_commit
+ * ------------
+ * Decommit the pages of a chunk, made inaccessible like the end of a top
+ * in heap_trim, or commit them again. The first page keeps the header and
+ * links, the last one the footer, which records the bytes decommitted.
+ *
+ * chunk: chunk in no list, its pages released before it is decommitted
+ * commit: 1 to commit, 0 to decommit
+ *
+ * return: 0 on success, -1 if OS refuses to commit
+ */
+static int depot_commit(Header * chunk, int commit) {
+  char * lo = (char *)ALIGN_UP(LENT(chunk) + 1, COMMIT_UNIT);
+  char * hi = (char *)((uintptr_t)&FOOTER(chunk) & ~(uintptr_t)(COMMIT_UNIT - 1));
+  if (!commit) {
+    FOOTER(chunk) = 0;
+    if (lo < hi && mprotect(lo, hi - lo, PROT_NONE) == 0) {
+      FOOTER(chunk) = hi - lo;
+      __atomic_sub_fetch(&footprint, hi - lo, __ATOMIC_RELAXED);
+    }
+    return 0;
+  }
+  if (FOOTER(chunk)) {
+    if (mprotect(lo, hi - lo, PROT_READ | PROT_WRITE) != 0) {
+      return -1;
+    }
+    __atomic_add_fetch(&footprint, hi - lo, __ATOMIC_RELAXED);
+  }
+  return 0;
+}
+
+
+/* release_block
+ * -------------
+ * Release the whole pages inside a free block. With HUGEPAGES only empty
+ * hugepages are released: those inside the block and those that hold
+ * nothing else. The first page keeps the header, links and the released
+ * size, the last one the footer, so the block is still managed as usual
+ * and only faults pages back in where it is allocated from again. Its
+ * size is recorded so the same block is not released twice.
+ *
+ * block: free block of at least RELEASE_THRESHOLD bytes
+ */
+static void release_block(Header * block) {
+  char * lo = (char *)ALIGN_UP(&RELEASED(block) + 1, COMMIT_UNIT);
+  char * hi = (char *)((uintptr_t)&FOOTER(block) & ~(uintptr_t)(COMMIT_UNIT - 1));
+#ifdef HUGEPAGES
+  // a hugepage holding nothing but an end of the block is empty as well
+  if (*huge_used(block) == 0) {
+    lo = (char *)ALIGN_UP(&RELEASED(block) + 1, PAGE_SIZE);
+  }
+  if (*huge_used(&FOOTER(block)) == 0) {
+    hi = (char *)((uintptr_t)&FOOTER(block) & ~(uintptr_t)(PAGE_SIZE - 1));
+  }
+#endif
+  if (lo < hi) {
+    madvise(lo, hi - lo, MADV_DONTNEED);
+  }
+  RELEASED(block) = block->size;
+}
+
+
+/* lock_init
+ * ---------
+ * Set up a lock that is not statically initialized.
+ *
+ * l: lock
+ */
+static inline void lock_init(Lock * l) {
+#ifndef PTHREAD_LOCKS
+  l->word = 0;
+#else
+  pthread_mutex_init(&l->mutex, NULL);
+#endif
+#ifdef LOCK_STATS
+  l->acquired = l->contended = l->parked = 0;
+#endif
+}
+
+
+/* lock_try
+ * --------
+ * Take a lock if it is free.
+ *
+ * l: lock
+ *
+ * return: 1 if taken, 0 if held by another thread
+ */
+static inline int lock_try(Lock * l) {
+#ifndef PTHREAD_LOCKS
+  int c = 0;
+  if (!__atomic_compare_exchange_n(&l->word, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+#else
+  if (pthread_mutex_trylock(&l->mutex) != 0) {
+    return 0;
+  }
+#endif
+  LOCK_COUNT(l, acquired, 1);
+  return 1;
+}
+
+
+/* lock_acquire
+ * ------------
+ * Take a lock, waiting for it if it is held.
+ *
+ * l: lock
+ */
+static inline void lock_acquire(Lock * l) {
+  if (!lock_try(l)) {
+    lock_wait(l);
+  }
+}
+
+
+/* lock_wait
+ * ---------
+ * Slow path of lock_acquire. Spin until the lock is free, at most
+ * lock_spins rounds and only while no thread is parked on it, then park on
+ * its futex. A thread that parks once marks the lock waited for (2) from
+ * then on, so the holder wakes the next waiter when it lets go.
+ *
+ * l: lock held by another thread
+ */
+static void lock_wait(Lock * l) {
+  unsigned long parked = 0;
+#ifndef PTHREAD_LOCKS
+  int spins = __atomic_load_n(&lock_spins, __ATOMIC_RELAXED);
+  if (spins < 0) {
+    spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? LOCK_SPINS : 0;
+    __atomic_store_n(&lock_spins, spins, __ATOMIC_RELAXED);
+  }
+  int c = 1;
+  for (int i = 0; i < spins && c == 1; i++) {
+    CPU_RELAX();
+    c = __atomic_load_n(&l->word, __ATOMIC_RELAXED);
+    if (c == 0) { // c is reloaded if another thread takes it first
+      __atomic_compare_exchange_n(&l->word, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+  }
+  if (c != 0) {
+    while (__atomic_exchange_n(&l->word, 2, __ATOMIC_ACQUIRE) != 0) {
+      syscall(SYS_futex, &l->word, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+      parked++;
+    }
+  }
+#else
+  pthread_mutex_lock(&l->mutex);
+#endif
+  LOCK_COUNT(l, acquired, 1);
+  LOCK_COUNT(l, contended, 1);
+  LOCK_COUNT(l, parked, parked);
+}
+
+
+/* lock_release
+ * ------------
+ * Let go of a lock, waking one parked thread if there may be any.
+ *
+ * l: lock held by the calling thread
+ */
+static inline void lock_release(Lock * l) {
+#ifndef PTHREAD_LOCKS
+  if (__atomic_exchange_n(&l->word, 0, __ATOMIC_RELEASE) == 2) {
+    syscall(SYS_futex, &l->word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+#else
+  pthread_mutex_unlock(&l->mutex);
+#endif
+}
+
+
+/* heap_lock
+ * ---------
+ * Lock a heap for an operation. An arena is always locked. A thread heap
+ * is only locked with SCAVENGER, against the scavenger, and its owner is
+ * the only other user of the lock.
+ *
+ * h: heap to lock
+ * need_lock: h is an arena
+ */
+static inline void heap_lock(Heap * h, int need_lock) {
+#ifndef SCAVENGER
+  if (!need_lock) {
+    return;
+  }
+#else
+  (void)need_lock;
+#endif
+  lock_acquire(&h->lock);
+}
+
+
+/* heap_unlock
+ * -----------
+ * Unlock a heap locked by heap_lock or arena_lock.
+ *
+ * h: heap to unlock
+ * need_lock: h is an arena
+ */
+static inline void heap_unlock(Heap * h, int need_lock) {
+#ifndef SCAVENGER
+  if (!need_lock) {
+    return;
+  }
+#else
+  (void)need_lock;
+#endif
+  lock_release(&h->lock);
+}
+
+
+/* arena_init
+ * ----------
+ * Set up ARENAS_PER_CPU arenas per online CPU, once.
+ */
+static void arena_init(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned long count = cpus > 0 ? (unsigned long)cpus * ARENAS_PER_CPU : 1;
+  if (count > MAX_ARENAS) {
+    count = MAX_ARENAS;
+  }
+  for (unsigned i = 0; i < count; i++) {
+    lock_init(&arenas[i].lock);
+    for (unsigned cls = 0; cls < NUM_SLAB_CLASSES; cls++) {
+      lock_init(&class_locks[i][cls].lock);
+    }
+  }
+  __atomic_store_n(&arena_count, count, __ATOMIC_RELEASE);
+}
+
+
+/* arena_get
+ * ---------
+ * The arena of the calling thread, assigned round robin on first use.
+ *
+ * return: the arena
+ */
+static inline Heap * arena_get(void) {
+  if (tls_arena == NULL) {
+    pthread_once(&arena_once, arena_init);
+    unsigned idx = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+    tls_arena = &arenas[idx % arena_count];
+  }
+  return tls_arena;
+}
+
+
+/* class_lock
+ * ----------
+ * The lock of a slab class of an arena, or its coarse lock.
+ *
+ * h: arena
+ * cls: size class, LARGE_CLASS for the coarse lock
+ *
+ * return: the lock
+ */
+static inline Lock * class_lock(Heap * h, unsigned cls) {
+  if (cls == LARGE_CLASS) {
+    return &h->lock;
+  }
+  return &class_locks[h - arenas][cls].lock;
+}
+
+
+/* arena_lock
+ * ----------
+ * Take a lock of the arena of the calling thread. If another thread holds
+ * it, the same lock of the other arenas is tried in turn and the first
+ * free one becomes the thread's arena. Only if all are held does the
+ * thread wait for its own.
+ *
+ * h: arena of the thread
+ * cls: size class, LARGE_CLASS for the coarse lock
+ *
+ * return: the locked arena
+ */
+static Heap * arena_lock(Heap * h, unsigned cls) {
+  if (lock_try(class_lock(h, cls))) {
+    return h;
+  }
+  unsigned idx = h - arenas;
+  for (unsigned i = 1; i < arena_count; i++) {
+    Heap * other = &arenas[(idx + i) % arena_count];
+    if (lock_try(class_lock(other, cls))) {
+      tls_arena = other;
+      return other;
+    }
+  }
+  lock_acquire(class_lock(h, cls));
+  return h;
+}
+
+
+/* ts_malloc_nolock
+ * -----------------
+ * Allocate memory with n bytes without using lock to achieve thread-safe malloc
+ *
+ * n: in bytes of requested memory
+ */
+void * ts_malloc_nolock(size_t n) {
+  if (tls_heap == NULL && heap_start() < 0) {
+    return NULL;
+  }
+  return my_malloc(n, tls_heap, 0);
+}
+
+
+/* heap_start
+ * ----------
+ * Give the calling thread a heap: the one most recently left by an exited
+ * thread, with all its free blocks and pending remote frees, or else a
+ * new one. The heap is registered to be orphaned when the thread exits.
+ *
+ * return: 0 on success, -1 if OS refuses
+ */
+static int heap_start(void) {
+  pthread_once(&heap_once, heap_key_init);
+  lock_acquire(&orphans_lock);
+  Heap * h = orphans;
+  if (h) {
+    orphans = h->orphan;
+  }
+  lock_release(&orphans_lock);
+  if (h == NULL && (h = heap_new()) == NULL) {
+    return -1;
+  }
+  pthread_setspecific(heap_key, h);
+  tls_heap = h;
+  return 0;
+}
+
+
+/* heap_key_init
+ * -------------
+ * Create the key whose destructor orphans a thread heap, once.
+ */
+static void heap_key_init(void) {
+  pthread_key_create(&heap_key, heap_exit);
+}
+
+
+/* heap_exit
+ * ---------
+ * Park the heap of an exiting thread on the orphan list for the next
+ * thread to adopt. Other threads keep pushing frees of its blocks on its
+ * remote stack meanwhile, the adopter drains them.
+ *
+ * arg: the thread heap
+ */
+static void heap_exit(void * arg) {
+  Heap * h = (Heap *)arg;
+  tls_heap = NULL;
+  lock_acquire(&orphans_lock);
+  h->orphan = orphans;
+  orphans = h;
+  lock_release(&orphans_lock);
+}
+
+
+/* heap_new
+ * --------
+ * Map a fresh, empty heap for a thread. Heaps are never unmapped, a heap
+ * left by an exited thread is adopted as a whole (see heap_start), so a
+ * block's owner pointer always names a heap that is in use or waits for
+ * its next owner. With SCAVENGER the heap is registered for the scavenger.
+ *
+ * return: the new heap, NULL if OS refuses
+ */
+Heap * heap_new(void) {
+  void * ptr = mmap(NULL, sizeof(Heap), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    return NULL;
+  }
+#ifdef SCAVENGER
+  Heap * h = (Heap *)ptr;
+  lock_init(&h->lock);
+  lock_acquire(&heaps_lock);
+  h->next = heaps;
+  heaps = h;
+  lock_release(&heaps_lock);
+#endif
+  return (Heap *)ptr;
+}
+
+
+/* ts_free_nolock
+ * -----------------
+ * Return the memory from user to the free list in a lock-free thread safe way.
+ * Blocks owned by another thread's heap are pushed on its remote stack,
+ * large ones go to the depot instead, mmapped blocks are unmapped by any
+ * thread. A heap whose bins grow too large gives free blocks to the depot.
+ *
+ * ptr: pointer to memory to return to free list
+ */
+void ts_free_nolock(void * ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  Span * span = pagemap_get(ptr);
+  if (span) {
+    if (span->heap == tls_heap) {
+      heap_lock(tls_heap, 0);
+      slab_free(tls_heap, span, ptr, 0);
+      heap_unlock(tls_heap, 0);
+    }
+    else {
+      remote_push(span->heap, ptr);
+    }
+    return;
+  }
+  if (IS_MMAPPED((Header *)ptr - 1)) {
+    mmap_free((Header *)ptr - 1);
+    return;
+  }
+  if (((Header *)ptr - 1)->heap != tls_heap) {
+    if (depot_cut((Header *)ptr - 1) < 0) {
+      remote_push(((Header *)ptr - 1)->heap, ptr);
+    }
+    return;
+  }
+  heap_lock(tls_heap, 0);
+  insert_free_list(ptr, tls_heap);
+  if (tls_heap->free_units * sizeof(Header) > DEPOT_THRESHOLD) {
+    depot_give(tls_heap);
+  }
+  heap_unlock(tls_heap, 0);
+}
+
+
+/* remote_push
+ * -----------
+ * Free a block or slab object of another thread's heap: push it on the
+ * remote stack of that heap, linked through its first word. Lock free,
+ * many threads may push while the owner drains.
+ *
+ * h: heap owning the memory
+ * ptr: memory to free
+ */
+static void remote_push(Heap * h, void * ptr) {
+  void * head = __atomic_load_n(&h->remote, __ATOMIC_RELAXED);
+  do {
+    *(void **)ptr = head;
+  } while (!__atomic_compare_exchange_n(&h->remote, &head, ptr, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/* remote_drain
+ * ------------
+ * Free everything other threads pushed on the remote stack of a heap. The
+ * whole stack is taken at once, so there is no ABA problem.
+ *
+ * h: thread heap of the caller, locked
+ */
+static void remote_drain(Heap * h) {
+  void * ptr = __atomic_exchange_n(&h->remote, NULL, __ATOMIC_ACQUIRE);
+  while (ptr) {
+    void * next = *(void **)ptr;
+    Span * span = pagemap_get(ptr);
+    if (span) {
+      slab_free(h, span, ptr, 0);
+    }
+    else {
+      insert_free_list(ptr, h);
+    }
+    ptr = next;
+  }
+}
+
+
+/* my_malloc
+ * ---------
+ * The actual memory allocator main logic. Small requests are served by the
+ * slab front end, large ones are mmapped on their own. Others search the
+ * segregated free lists for suitable block and return a chopped block if
+ * found. Otherwise the block is bumped off the top of the heap, which asks
+ * OS for more space when it runs out.
+ * If need lock, h is the thread's arena. A small request takes the lock
+ * of its class only, the rest the coarse lock, of h or of another arena
+ * if it is busy (see arena_lock). A thread heap first takes back what
+ * other threads freed to it.
+ *
+ * n: size in bytes of requested memo
+ * h: heap to allocate from
+ * need_lock: indicate use of lock or not
+ *
+ * return: pointer to the allocated memory
+ */
+void * my_malloc(size_t n, Heap * h, int need_lock) {
+  if (n > SIZE_MAX - MIN_UNITS * sizeof(Header)) {
+    return NULL;
+  }
+  if (n >= MMAP_THRESHOLD) {
+    return mmap_alloc(n);
+  }
+  size_t sunits = (n + sizeof(Header) - 1) / sizeof(Header) + 1;
+  if (sunits < MIN_UNITS) {
+    sunits = MIN_UNITS;
+  }
+  void * res = NULL;
+  if (need_lock) {
+    if (n < SLAB_MAX) {
+      unsigned cls = slab_class(n);
+      h = arena_lock(h, cls);
+      res = slab_malloc(h, n, 1);
+      lock_release(class_lock(h, cls));
+      if (res) {
+        return res;
+      }
+    }
+    h = arena_lock(h, LARGE_CLASS); // lock access to free list
+  }
+  else {
+    heap_lock(h, 0);
+    if (__atomic_load_n(&h->remote, __ATOMIC_RELAXED)) {
+      remote_drain(h);
+    }
+    if (n < SLAB_MAX) {
+      res = slab_malloc(h, n, 0);
+    }
+  }
+  if (res == NULL) { // not small, or no span could be set up
+    Header * best = find_block(h, sunits);
+    if (best == NULL && __atomic_load_n(&h->lent, __ATOMIC_RELAXED) && depot_reclaim(h)) {
+      best = find_block(h, sunits);
+    }
+    if (best) {
+      res = processBlock(h, best, sunits);
+    }
+    else {
+      while ((best = top_alloc(h, sunits)) == NULL) { // bump off the top
+        if (malloc_sys(sunits, h) == NULL) {
+          break;
+        }
+      }
+      if (best) {
+        res = (void *)(best + 1);
+      }
+    }
+  }
+  heap_unlock(h, need_lock); // unlock
+  return res;
+}
+
+
+/* pagemap_get
+ * -----------
+ * Look up the span covering an address. Lock free, leaves of the map are
+ * never removed once published.
+ *
+ * ptr: any address
+ *
+ * return: the span, NULL if ptr is not a slab object
+ */
+static inline Span * pagemap_get(void * ptr) {
+  uintptr_t key = (uintptr_t)ptr >> SPAN_SHIFT;
+  if (key >> (2 * PAGEMAP_BITS)) {
+    return NULL;
+  }
+  Span ** leaf = __atomic_load_n(&pagemap[key >> PAGEMAP_BITS], __ATOMIC_ACQUIRE);
+  if (leaf == NULL) {
+    return NULL;
+  }
+  return __atomic_load_n(&leaf[key & (PAGEMAP_SIZE - 1)], __ATOMIC_RELAXED);
+}
+
+
+/* pagemap_set
+ * -----------
+ * Record the span covering the SPAN_SIZE bytes from its block header,
+ * mapping a leaf of the map first if needed.
+ *
+ * span: span whose range is set
+ * value: span or NULL to clear the range
+ *
+ * return: 0 on success, -1 if the range can not be mapped
+ */
+static int pagemap_set(Span * span, Span * value) {
+  uintptr_t key = (uintptr_t)((Header *)span - 1) >> SPAN_SHIFT;
+  if (key >> (2 * PAGEMAP_BITS)) {
+    return -1;
+  }
+  Span *** root = &pagemap[key >> PAGEMAP_BITS];
+  if (__atomic_load_n(root, __ATOMIC_ACQUIRE) == NULL) {
+    lock_acquire(&pagemap_lock);
+    if (*root == NULL) {
+      void * leaf = mmap(NULL, PAGEMAP_SIZE * sizeof(Span *), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (leaf != MAP_FAILED) {
+        __atomic_store_n(root, (Span **)leaf, __ATOMIC_RELEASE);
+      }
+    }
+    lock_release(&pagemap_lock);
+    if (*root == NULL) {
+      return -1;
+    }
+  }
+  __atomic_store_n(&(*root)[key & (PAGEMAP_SIZE - 1)], value, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+/* slab_class
+ * ----------
+ * Map a small request to its size class: steps of 16 bytes up to 128,
+ * then four classes per power of two up to SLAB_MAX. Objects of a span
+ * are adjacent, a power of two request fills its class exactly.
+ *
+ * n: requested bytes, less than SLAB_MAX
+ *
+ * return: the size class
+ */
+static inline unsigned slab_class(size_t n) {
+  if (n <= 128) {
+    return n ? (n - 1) >> 4 : 0;
+  }
+  unsigned lg = BITS_PER_WORD - 1 - __builtin_clzl(n - 1);
+  return 8 + ((lg - 7) << 2) + (((n - 1) >> (lg - 2)) & 3);
+}
+
+
+/* span_new
+ * --------
+ * Set up a span for a size class, reusing the spare span of the heap or
+ * carving a SPAN_SIZE aligned block out of it. The caller holds the lock
+ * of the class.
+ *
+ * h: heap to take the span from
+ * cls: size class of the span
+ * need_lock: h is an arena, its coarse lock is taken for the span
+ *
+ * return: the span, NULL if no memory
+ */
+static Span * span_new(Heap * h, unsigned cls, int need_lock) {
+  if (need_lock) {
+    heap_lock(h, 1);
+  }
+  Span * span = h->spare;
+  if (span) {
+    h->spare = NULL;
+  }
+  else {
+    Header * block = alloc_aligned(h, SPAN_SIZE / sizeof(Header), SPAN_SIZE);
+    if (block) {
+      span = (Span *)(block + 1);
+      if (pagemap_set(span, span) < 0) {
+        insert_free_list((void *)span, h);
+        span = NULL;
+      }
+      else {
+        span->heap = h;
+        span->end = (char *)block + SPAN_SIZE;
+      }
+    }
+  }
+  if (need_lock) {
+    heap_unlock(h, 1);
+  }
+  if (span == NULL) {
+    return NULL;
+  }
+  if (cls < 8) {
+    span->obj_size = (cls + 1) << 4;
+  }
+  else {
+    unsigned lg = 7 + ((cls - 8) >> 2);
+    span->obj_size = ((size_t)1 << lg) + (((size_t)(cls & 3) + 1) << (lg - 2));
+  }
+  span->cls = cls;
+  span->used = 0;
+  span->free = NULL;
+  span->bump = (char *)ALIGN_UP(span + 1, sizeof(Header));
+  span->prev = NULL;
+  span->next = h->slabs[cls];
+  if (span->next) {
+    span->next->prev = span;
+  }
+  h->slabs[cls] = span;
+  return span;
+}
+
+
+/* slab_malloc
+ * -----------
+ * Hand out an object from the first span of the class that has one free,
+ * a span that runs full leaves the list of its class.
+ *
+ * h: heap owning the spans
+ * n: requested bytes, less than SLAB_MAX
+ * need_lock: h is an arena and the caller holds the lock of the class only
+ *
+ * return: the object, NULL if no span could be set up
+ */
+static void * slab_malloc(Heap * h, size_t n, int need_lock) {
+  unsigned cls = slab_class(n);
+  Span * span = h->slabs[cls];
+  if (span == NULL && (span = span_new(h, cls, need_lock)) == NULL) {
+    return NULL;
+  }
+  void * obj = span->free;
+  if (obj) {
+    span->free = *(void **)obj;
+  }
+  else {
+    obj = span->bump;
+    span->bump += span->obj_size;
+  }
+  span->used++;
+  if (span->free == NULL && span->bump + span->obj_size > span->end) { // full
+    h->slabs[cls] = span->next;
+    if (span->next) {
+      span->next->prev = NULL;
+#ifdef HUGEPAGES
+      span_pick(h, cls);
+#endif
+    }
+  }
+  return obj;
+}
+
+
+/* slab_free
+ * ---------
+ * Return an object to its span. A full span goes back on the list of its
+ * class, an empty one becomes the spare of the heap or, if there already
+ * is one, goes back to the free lists as an ordinary block.
+ *
+ * h: heap owning the span
+ * span: span of the object
+ * ptr: object to free
+ * need_lock: h is an arena and the caller holds the lock of the class only
+ */
+static void slab_free(Heap * h, Span * span, void * ptr, int need_lock) {
+  int was_full = span->free == NULL && span->bump + span->obj_size > span->end;
+  *(void **)ptr = span->free;
+  span->free = ptr;
+  if (was_full) {
+    span->prev = NULL;
+    span->next = h->slabs[span->cls];
+    if (span->next) {
+      span->next->prev = span;
+    }
+    h->slabs[span->cls] = span;
+  }
+  if (--span->used) {
+    return;
+  }
+  if (span->prev) {
+    span->prev->next = span->next;
+  }
+  else {
+    h->slabs[span->cls] = span->next;
+  }
+  if (span->next) {
+    span->next->prev = span->prev;
+  }
+  if (need_lock) {
+    heap_lock(h, 1);
+  }
+  if (h->spare == NULL) {
+    h->spare = span;
+  }
+  else {
+    pagemap_set(span, NULL);
+    insert_free_list((void *)span, h);
+  }
+  if (need_lock) {
+    heap_unlock(h, 1);
+  }
+}
+
+
+
+
+/* tcache_start
+ * ------------
+ * Set up the thread cache on first use: register it to be flushed when
+ * the thread exits. A cache that was flushed on exit stays off. With
+ * PERCPU the caches of the CPUs are used instead if rseq is available.
+ *
+ * return: 0 if the cache can be used, -1 if not
+ */
+static int tcache_start(void) {
+  if (tcache.state == 0) {
+#ifdef PERCPU
+    if (rseq_start() == 0) {
+      tcache.state = 2;
+      return 0;
+    }
+#endif
+    pthread_once(&tcache_once, tcache_key_init);
+    tcache.state = pthread_setspecific(tcache_key, &tcache) == 0 ? 1 : -1;
+  }
+  return tcache.state > 0 ? 0 : -1;
+}
+
+
+/* tcache_key_init
+ * ---------------
+ * Create the key whose destructor flushes a thread cache, once.
+ */
+static void tcache_key_init(void) {
+  pthread_key_create(&tcache_key, tcache_exit);
+}
+
+
+/* tcache_refill
+ * -------------
+ * Fill the empty cache of a class with a batch of objects of the thread's
+ * arena, taken under one hold of its class lock.
+ *
+ * n: requested bytes, less than SLAB_MAX
+ *
+ * return: an object for the request, NULL if the cache is off or no span
+ * could be set up
+ */
+static void * tcache_refill(size_t n) {
+  if (tcache_start() < 0) {
+    return NULL;
+  }
+#ifdef PERCPU
+  if (tcache.state == 2) {
+    return percpu_refill(n);
+  }
+#endif
+  unsigned cls = slab_class(n);
+  Heap * h = arena_lock(arena_get(), cls);
+  void * obj = slab_malloc(h, n, 1);
+  for (unsigned i = 1; obj && i < TCACHE_BATCH; i++) {
+    void * more = slab_malloc(h, n, 1);
+    if (more == NULL) {
+      break;
+    }
+    tcache.objs[cls][tcache.count[cls]++] = more;
+  }
+  lock_release(class_lock(h, cls));
+  return obj;
+}
+
+
+/* tcache_flush
+ * ------------
+ * Return the oldest cached objects of a class to their spans in the
+ * arenas (see cache_release). The newer ones, still warm in the cache of
+ * the CPU, move down the stack.
+ *
+ * cls: size class
+ * count: number of objects, at most the number cached
+ */
+static void tcache_flush(unsigned cls, unsigned count) {
+  void ** objs = tcache.objs[cls];
+  cache_release(objs, count);
+  tcache.count[cls] -= count;
+  for (unsigned i = 0; i < tcache.count[cls]; i++) {
+    objs[i] = objs[i + count];
+  }
+}
+
+
+/* cache_release
+ * -------------
+ * Return cached objects of one class to their spans. Objects of one
+ * arena, usually all of them, are freed under one hold of its class lock.
+ *
+ * objs: objects
+ * count: number of objects
+ */
+static void cache_release(void ** objs, unsigned count) {
+  Lock * lock = NULL;
+  for (unsigned i = 0; i < count; i++) {
+    Span * span = pagemap_get(objs[i]);
+    if (class_lock(span->heap, span->cls) != lock) {
+      if (lock) {
+        lock_release(lock);
+      }
+      lock = class_lock(span->heap, span->cls);
+      lock_acquire(lock);
+    }
+    slab_free(span->heap, span, objs[i], 1);
+  }
+  if (lock) {
+    lock_release(lock);
+  }
+}
+
+
+/* tcache_exit
+ * -----------
+ * Flush the whole cache of an exiting thread, so its objects can be used
+ * by others, and turn the cache off for later frees of the thread. An
+ * rseq area registered by rseq_start is unregistered before its thread
+ * storage goes away.
+ *
+ * arg: the thread cache
+ */
+static void tcache_exit(void * arg) {
+  (void)arg;
+  for (unsigned cls = 0; cls < NUM_SLAB_CLASSES; cls++) {
+    if (tcache.count[cls]) {
+      tcache_flush(cls, tcache.count[cls]);
+    }
+  }
+  tcache.state = -1;
+#if defined(PERCPU) && defined(SYS_rseq)
+  if (tls_rseq == &rseq_area) {
+    syscall(SYS_rseq, &rseq_area, sizeof(rseq_area), RSEQ_FLAG_UNREGISTER, RSEQ_SIG);
+    tls_rseq = NULL;
+  }
+#endif
+}
+
+#ifdef PERCPU
+// restartable sequence on the stack of a class of the current CPU. The
+// descriptor of the sequence goes to the __rseq_cs section and the thread
+// points its rseq area at it. The sequence runs from 1 to the commit store
+// ending at 2, on abort the kernel clears the pointer and resumes at 4,
+// after the signature, which starts over. The CPU is read inside the
+// sequence, rax is left pointing at the count of the stack and rcx holds
+// it. A CPU without stacks leaves for 5
+#define RSEQ_ENTER \
+  ".pushsection __rseq_cs, \"aw\"\n\t" \
+  ".balign 32\n" \
+  "3:\n\t" \
+  ".long 0, 0\n\t" \
+  ".quad 1f, 2f - 1f, 4f\n\t" \
+  ".popsection\n" \
+  "0:\n\t" \
+  "leaq 3b(%%rip), %%rax\n\t" \
+  "movq %%rax, %c[cs](%[rseq])\n" \
+  "1:\n\t" \
+  "movl %c[cpu](%[rseq]), %%eax\n\t" \
+  "cmpl %[ncpu], %%eax\n\t" \
+  "jae 5f\n\t" \
+  "shlq %[shift], %%rax\n\t" \
+  "addq %[stack], %%rax\n\t" \
+  "movq (%%rax), %%rcx\n\t"
+
+#define RSEQ_ABORT \
+  ".byte 0x0f, 0xb9, 0x3d\n\t" \
+  ".long " RSEQ_SIG_STR "\n" \
+  "4:\n\t" \
+  "jmp 0b\n"
+
+#define RSEQ_STR(x) #x
+#define RSEQ_XSTR(x) RSEQ_STR(x)
+#define RSEQ_SIG_STR RSEQ_XSTR(RSEQ_SIG)
+
+#define RSEQ_INPUTS(cls) \
+  [rseq] "r" (tls_rseq), [stack] "r" (pcpu + (cls) * PCPU_STRIDE), \
+  [ncpu] "rm" (pcpu_count), [shift] "i" (PCPU_SHIFT), \
+  [cpu] "i" (offsetof(struct rseq, cpu_id)), [cs] "i" (offsetof(struct rseq, rseq_cs))
+
+
+/* rseq_start
+ * ----------
+ * Find the rseq area of the thread: the one glibc registered, or else one
+ * registered here, which tcache_exit unregisters when the thread exits.
+ *
+ * return: 0 if the per-CPU caches can be used, -1 if not
+ */
+static int rseq_start(void) {
+#ifdef SYS_rseq
+  pthread_once(&pcpu_once, percpu_init);
+  if (pcpu == NULL) {
+    return -1;
+  }
+#ifdef GLIBC_RSEQ
+  if (__rseq_size) {
+    tls_rseq = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+    return (int)tls_rseq->cpu_id >= 0 ? 0 : -1;
+  }
+#endif
+  pthread_once(&tcache_once, tcache_key_init);
+  if (pthread_setspecific(tcache_key, &tcache) != 0) {
+    return -1;
+  }
+  if (syscall(SYS_rseq, &rseq_area, sizeof(rseq_area), 0, RSEQ_SIG) == 0) {
+    tls_rseq = &rseq_area;
+    return 0;
+  }
+#endif
+  return -1;
+}
+
+
+/* percpu_init
+ * -----------
+ * Map the stacks of all configured CPUs, once. Their pages are only
+ * touched by the CPUs that use them.
+ */
+static void percpu_init(void) {
+  long count = sysconf(_SC_NPROCESSORS_CONF);
+  if (count <= 0) {
+    return;
+  }
+  void * ptr = mmap(NULL, (size_t)count << PCPU_SHIFT, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr != MAP_FAILED) {
+    pcpu_count = count;
+    pcpu = (char *)ptr;
+  }
+}
+
+
+/* percpu_pop
+ * ----------
+ * Take the newest object off the stack of a class of the current CPU.
+ *
+ * cls: size class
+ *
+ * return: the object, NULL if the stack is empty
+ */
+static inline void * percpu_pop(unsigned cls) {
+  void * obj;
+  __asm__ __volatile__ (
+    RSEQ_ENTER
+    "testq %%rcx, %%rcx\n\t"
+    "jz 5f\n\t"
+    "movq (%%rax, %%rcx, 8), %[obj]\n\t"
+    "decq %%rcx\n\t"
+    "movq %%rcx, (%%rax)\n" // commit
+    "2:\n\t"
+    "jmp 6f\n\t"
+    RSEQ_ABORT
+    "5:\n\t"
+    "xorl %k[obj], %k[obj]\n"
+    "6:\n"
+    : [obj] "=&r" (obj)
+    : RSEQ_INPUTS(cls)
+    : "rax", "rcx", "memory", "cc");
+  return obj;
+}
+
+
+/* percpu_push
+ * -----------
+ * Put an object on the stack of a class of the current CPU.
+ *
+ * cls: size class
+ * obj: object to cache
+ *
+ * return: 1 if cached, 0 if the stack is full
+ */
+static inline int percpu_push(unsigned cls, void * obj) {
+  int done = 0;
+  __asm__ __volatile__ (
+    RSEQ_ENTER
+    "cmpq %[count], %%rcx\n\t"
+    "jae 5f\n\t"
+    "movq %[obj], 8(%%rax, %%rcx, 8)\n\t"
+    "incq %%rcx\n\t"
+    "movq %%rcx, (%%rax)\n" // commit
+    "2:\n\t"
+    "movl $1, %[done]\n\t"
+    "jmp 5f\n\t"
+    RSEQ_ABORT
+    "5:\n"
+    : [done] "+r" (done)
+    : [obj] "r" (obj), [count] "i" (TCACHE_COUNT), RSEQ_INPUTS(cls)
+    : "rax", "rcx", "memory", "cc");
+  return done;
+}
+
+
+/* percpu_refill
+ * -------------
+ * Fill the empty stack of a class of the current CPU with a batch of
+ * objects of the thread's arena, taken under one hold of its class lock.
+ * Objects that find the stack filled by another thread meanwhile go back.
+ *
+ * n: requested bytes, less than SLAB_MAX
+ *
+ * return: an object for the request, NULL if no span could be set up
+ */
+static void * percpu_refill(size_t n) {
+  unsigned cls = slab_class(n), count = 0, i = 1;
+  void * objs[TCACHE_BATCH];
+  Heap * h = arena_lock(arena_get(), cls);
+  while (count < TCACHE_BATCH && (objs[count] = slab_malloc(h, n, 1)) != NULL) {
+    count++;
+  }
+  lock_release(class_lock(h, cls));
+  if (count == 0) {
+    return NULL;
+  }
+  while (i < count && percpu_push(cls, objs[i])) {
+    i++;
+  }
+  cache_release(objs + i, count - i);
+  return objs[0];
+}
+
+
+/* percpu_flush
+ * ------------
+ * Return a batch of objects from the full stack of a class of the current
+ * CPU to the arenas. Unlike the thread cache the newest are taken,
+ * the stack can only be changed at its top.
+ *
+ * cls: size class
+ *
+ * return: number of objects returned
+ */
+static unsigned percpu_flush(unsigned cls) {
+  void * objs[TCACHE_BATCH];
+  unsigned count = 0;
+  while (count < TCACHE_BATCH && (objs[count] = percpu_pop(cls)) != NULL) {
+    count++;
+  }
+  cache_release(objs, count);
+  return count;
+}
+#endif
+
+#ifdef HUGEPAGES
+/* hugemap_grow
+ * ------------
+ * Map the leaves of the occupancy map that cover a range of a heap about
+ * to be committed. Leaves are never removed once published.
+ *
+ * lo: start of the range
+ * hi: end of the range
+ *
+ * return: 0 on success, -1 if a leaf can not be mapped
+ */
+static int hugemap_grow(char * lo, char * hi) {
+  uintptr_t key = (uintptr_t)lo >> (HUGE_SHIFT + HUGEMAP_BITS);
+  uintptr_t last = ((uintptr_t)hi - 1) >> (HUGE_SHIFT + HUGEMAP_BITS);
+  if (last >= HUGEMAP_ROOT) {
+    return -1;
+  }
+  for (; key <= last; key++) {
+    if (__atomic_load_n(&hugemap[key], __ATOMIC_ACQUIRE)) {
+      continue;
+    }
+    lock_acquire(&hugemap_lock);
+    if (hugemap[key] == NULL) {
+      void * leaf = mmap(NULL, HUGEMAP_SIZE * sizeof(unsigned), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (leaf != MAP_FAILED) {
+        __atomic_store_n(&hugemap[key], (unsigned *)leaf, __ATOMIC_RELEASE);
+      }
+    }
+    lock_release(&hugemap_lock);
+    if (hugemap[key] == NULL) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+/* huge_used
+ * ---------
+ * Look up the occupancy of the hugepage holding an address. A hugepage
+ * belongs to a single heap, its count is guarded by that heap's lock.
+ *
+ * ptr: address inside a committed heap range
+ *
+ * return: the units in use in the hugepage
+ */
+static inline unsigned * huge_used(void * ptr) {
+  uintptr_t key = (uintptr_t)ptr >> HUGE_SHIFT;
+  return &hugemap[key >> HUGEMAP_BITS][key & (HUGEMAP_SIZE - 1)];
+}
+
+
+/* huge_account
+ * ------------
+ * Count a block that is handed out in the hugepages it covers, or take a
+ * block that is freed off them. The top is never counted.
+ *
+ * block: heap block of its final size
+ * in_use: 1 if the block is handed out, 0 if it is freed
+ */
+static void huge_account(Header * block, int in_use) {
+  char * lo = (char *)block, * hi = (char *)(block + block->size);
+  while (lo < hi) {
+    char * next = (char *)ALIGN_UP(lo + 1, HUGE_PAGE_SIZE);
+    if (next > hi) {
+      next = hi;
+    }
+    unsigned units = (next - lo) / sizeof(Header);
+    if (in_use) {
+      *huge_used(lo) += units;
+    }
+    else {
+      *huge_used(lo) -= units;
+    }
+    lo = next;
+  }
+}
+
+
+/* huge_pick
+ * ---------
+ * Choose among a best fit and the next HUGE_CANDIDATES - 1 blocks that
+ * fit as well the one whose allocation lands in the fullest hugepage.
+ * processBlock carves from the end of a block, so that is where the
+ * hugepage is looked up. The blocks after the best fit in its list, or
+ * the larger ones in its tree, all fit.
+ *
+ * best: best fitting free block
+ * units: requested size in header-sized units
+ * list: best sits in a list, not in a tree bin
+ *
+ * return: the block to allocate from
+ */
+static Header * huge_pick(Header * best, size_t units, int list) {
+#ifdef TLSF_VERSION
+  (void)list;
+#endif
+  Header * pick = best, * b = best;
+  unsigned most = *huge_used(best + best->size - units);
+  for (unsigned i = 1; i < HUGE_CANDIDATES; i++) {
+#ifdef TLSF_VERSION
+    b = LINKS(b)->next;
+#else
+    b = list ? LINKS(b)->next : tree_next(b);
+#endif
+    if (b == NULL) {
+      break;
+    }
+    unsigned used = *huge_used(b + b->size - units);
+    if (used > most) {
+      most = used;
+      pick = b;
+    }
+  }
+  return pick;
+}
+
+
+/* span_pick
+ * ---------
+ * Move the fullest of the first HUGE_CANDIDATES spans of a class to the
+ * front of its list, once the span in front runs full. Objects are thus
+ * packed into few spans and sparse ones are left to drain, so that they
+ * go back to the heap and free their hugepage.
+ *
+ * h: heap owning the spans
+ * cls: size class
+ */
+static void span_pick(Heap * h, unsigned cls) {
+  Span * head = h->slabs[cls], * pick = head;
+  Span * span = head->next;
+  for (unsigned i = 1; span && i < HUGE_CANDIDATES; i++, span = span->next) {
+    if (span->used > pick->used) {
+      pick = span;
+    }
+  }
+  if (pick == head) {
+    return;
+  }
+  pick->prev->next = pick->next;
+  if (pick->next) {
+    pick->next->prev = pick->prev;
+  }
+  pick->prev = NULL;
+  pick->next = head;
+  head->prev = pick;
+  h->slabs[cls] = pick;
+}
+#endif
+
+#ifdef SCAVENGER
+/* scavenger_start
+ * ---------------
+ * Start the scavenger thread, once, when the first heap grows.
+ */
+static void scavenger_start(void) {
+  pthread_t tid;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&tid, &attr, scavenger, NULL);
+  pthread_attr_destroy(&attr);
+}
+
+
+/* scavenger
+ * ---------
+ * Body of the scavenger thread: every quarter of DECAY_TIME visit the
+ * arenas and all thread heaps, and drop the cached mappings past their
+ * age. Heaps are never unmapped, so the list can be walked without
+ * holding heaps_lock.
+ *
+ * arg: unused
+ */
+static void * scavenger(void * arg) {
+  (void)arg;
+  struct timespec period = {DECAY_TIME / 4000, DECAY_TIME / 4 % 1000 * 1000000L};
+  for (;;) {
+    nanosleep(&period, NULL);
+    unsigned count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < count; i++) {
+      scavenge(&arenas[i], 1);
+    }
+    lock_acquire(&heaps_lock);
+    Heap * h = heaps;
+    lock_release(&heaps_lock);
+    for (; h; h = h->next) {
+      scavenge(h, 0);
+    }
+    mmap_cache_trim();
+  }
+  return NULL;
+}
+
+
+/* scavenge
+ * --------
+ * Release the decayed free blocks of a heap. A batch is claimed from the
+ * head of the decay list under the heap lock: taken out of the bins and
+ * marked in use, so that neither allocation nor coalescing touches it.
+ * The pages are released with the lock dropped and the batch is freed
+ * again under the lock. A lock hold thus visits at most SCAVENGE_BATCH
+ * blocks, however many are free.
+ *
+ * h: heap to scavenge
+ * need_lock: h is an arena
+ */
+static void scavenge(Heap * h, int need_lock) {
+  Header * batch[SCAVENGE_BATCH];
+  unsigned n;
+  do {
+    heap_lock(h, need_lock);
+    unsigned long now = now_ms();
+    for (n = 0; n < SCAVENGE_BATCH && h->decay && now - FREED_AT(h->decay) >= DECAY_TIME; n++) {
+      batch[n] = h->decay;
+      bin_remove(h, batch[n]); // leaves the decay list as well
+      batch[n]->flags |= CINUSE;
+      (batch[n] + batch[n]->size)->flags |= PINUSE;
+    }
+    heap_unlock(h, need_lock);
+    for (unsigned i = 0; i < n; i++) {
+      release_block(batch[i]);
+    }
+    heap_lock(h, need_lock);
+    for (unsigned i = 0; i < n; i++) {
+#ifdef HUGEPAGES
+      huge_account(batch[i], 1); // claimed blocks are not counted
+#endif
+      insert_free_list((void *)(batch[i] + 1), h);
+    }
+    heap_unlock(h, need_lock);
+  } while (n == SCAVENGE_BATCH);
+}
+
+
+/* decay_push
+ * ----------
+ * Append a binned block that is not released to the decay list of its
+ * heap, stamped with the time. Blocks are appended in time order, so the
+ * list stays ordered by age.
+ *
+ * h: heap owning the block, locked
+ * block: free block of RELEASE_THRESHOLD bytes and more
+ */
+static void decay_push(Heap * h, Header * block) {
+  FREED_AT(block) = now_ms();
+  DECAY(block)->next = NULL;
+  DECAY(block)->prev = h->decay_tail;
+  if (h->decay_tail) {
+    DECAY(h->decay_tail)->next = block;
+  }
+  else {
+    h->decay = block;
+  }
+  h->decay_tail = block;
+}
+
+
+/* decay_remove
+ * ------------
+ * Unlink a block leaving the bins from the decay list of its heap.
+ *
+ * h: heap owning the block, locked
+ * block: block on the decay list
+ */
+static void decay_remove(Heap * h, Header * block) {
+  if (DECAY(block)->prev) {
+    DECAY(DECAY(block)->prev)->next = DECAY(block)->next;
+  }
+  else {
+    h->decay = DECAY(block)->next;
+  }
+  if (DECAY(block)->next) {
+    DECAY(DECAY(block)->next)->prev = DECAY(block)->prev;
+  }
+  else {
+    h->decay_tail = DECAY(block)->prev;
+  }
+}
+#endif
@@ -6,22 +6,142 @@
 typedef double align; // alignment type
 typedef union header_t { // free list data structure
   struct {
-    union header_t * next;
-    size_t size;
-    pthread_t tid;
+    size_t size : 62; // in header units
+    size_t flags : 2; // boundary tag bits
+    struct heap_t * heap; // owner
   };
   align al; // not used, simply for alignment
 } Header;
 
 
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+
+// allocator locks
+// spin briefly, then park in the kernel on a futex; PTHREAD_LOCKS builds
+// them on pthread mutexes instead, LOCK_STATS counts their acquisitions
+typedef struct lock_t {
+#ifndef PTHREAD_LOCKS
+  int word; // 0 free, 1 held, 2 held and maybe waited for
+#else
+  pthread_mutex_t mutex;
+#endif
+#ifdef LOCK_STATS
+  unsigned long acquired; // counters written while held
+  unsigned long contended;
+  unsigned long parked;
+#endif
+} Lock;
+
+typedef struct lock_stats_t { // sums over all locks, zero without LOCK_STATS
+  unsigned long acquired; // acquisitions
+  unsigned long contended; // of them found the lock held
+  unsigned long parked; // times a thread slept in the kernel for a lock
+} LockStats;
+
+
+// slab front end
+// requests below SLAB_MAX bytes are served from spans of SPAN_SIZE bytes
+// holding objects of a single size class and no Header per object
+#define SLAB_MAX 1024
+#define NUM_SLAB_CLASSES 20
+#define SPAN_SHIFT 16
+#define SPAN_SIZE ((size_t)1 << SPAN_SHIFT)
+
+typedef struct span_t { // span of small objects, at the start of a block
+  struct span_t * next; // spans of the same class with free objects
+  struct span_t * prev;
+  struct heap_t * heap; // owner
+  void * free; // intrusive list of freed objects
+  char * bump; // first object never handed out
+  char * end; // end of the objects
+  size_t obj_size; // in bytes
+  unsigned cls; // size class
+  unsigned used; // objects handed out
+} Span;
+
+#ifdef TLSF_VERSION
+// two-level segregated fit: the first level splits sizes by power of two,
+// the second level splits each power of two into SL_COUNT linear lists.
+// Blocks smaller than SL_COUNT units all live in first level 0
+#define SL_BITS 4
+#define SL_COUNT (1 << SL_BITS)
+#define FL_COUNT (62 - SL_BITS + 1)
+
+typedef struct heap_t { // two-level free lists of one thread or an arena
+  Span * slabs[NUM_SLAB_CLASSES]; // spans with free objects by class
+  Span * spare; // empty span kept for the next class that needs one
+  Header * top; // untouched end of the newest chunk, bumped on a miss
+  size_t grow; // bytes the next chunk is asked for at least
+  size_t region; // bytes the next region is reserved with at least
+  Header * fence; // fence of the newest chunk
+  char * commit; // end of the committed part of the newest region
+  char * reserve; // end of the newest region
+  Lock lock; // arena lock, of a thread heap only with SCAVENGER
+  void * remote; // blocks freed by other threads, a lock-free stack
+  struct heap_t * orphan; // next heap left by an exited thread
+  size_t free_units; // units of all blocks in the bins
+  Header * lent; // chunks cut from this heap waiting in the depot
+#ifdef SCAVENGER
+  struct heap_t * next; // thread heaps known to the scavenger
+  Header * decay; // large free blocks not released yet, oldest first
+  Header * decay_tail;
+#endif
+  unsigned long fl_bitmap; // bit set for every first level with a block
+  unsigned sl_bitmap[FL_COUNT]; // bit set for every non-empty list
+  Header * bins[FL_COUNT][SL_COUNT]; // free blocks by size class
+} Heap;
+#else
+// size classes
+// blocks smaller than NUM_EXACT_BINS units have a bin of their own size,
+// larger blocks share geometric bins, SUB_BINS of them per power of two.
+// Exact bins are lists, geometric bins are red-black trees
+#define EXACT_BIN_BITS 6
+#define NUM_EXACT_BINS (1 << EXACT_BIN_BITS)
+#define SUB_BIN_BITS 2
+#define SUB_BINS (1 << SUB_BIN_BITS)
+#define NUM_BINS 128
+#define BINMAP_WORDS (NUM_BINS / BITS_PER_WORD)
+
+typedef struct heap_t { // segregated free lists of one thread or an arena
+  Header * bins[NUM_BINS]; // free blocks by size class, list or tree root
+  unsigned long binmap[BINMAP_WORDS]; // bit set for every non-empty bin
+  Span * slabs[NUM_SLAB_CLASSES]; // spans with free objects by class
+  Span * spare; // empty span kept for the next class that needs one
+  Header * top; // untouched end of the newest chunk, bumped on a miss
+  size_t grow; // bytes the next chunk is asked for at least
+  size_t region; // bytes the next region is reserved with at least
+  Header * fence; // fence of the newest chunk
+  char * commit; // end of the committed part of the newest region
+  char * reserve; // end of the newest region
+  Lock lock; // arena lock, of a thread heap only with SCAVENGER
+  void * remote; // blocks freed by other threads, a lock-free stack
+  struct heap_t * orphan; // next heap left by an exited thread
+  size_t free_units; // units of all blocks in the bins
+  Header * lent; // chunks cut from this heap waiting in the depot
+#ifdef SCAVENGER
+  struct heap_t * next; // thread heaps known to the scavenger
+  Header * decay; // large free blocks not released yet, oldest first
+  Header * decay_tail;
+#endif
+} Heap;
+#endif
+
+
 // use lock
+// threads share arenas, every arena has a lock of its own
 void * ts_malloc_lock(size_t n);
 void ts_free_lock(void * ptr);
 
 // no lock thread safe
-// only locks for calling sbrk
-// sbrk is not thread safe
+// every thread allocates from a heap of its own
 void * ts_malloc_nolock(size_t n);
 void ts_free_nolock(void * ptr);
 
+// memory committed to heaps in bytes
+size_t ts_footprint(void);
+
+// acquisitions of the allocator locks
+void ts_lock_stats(LockStats * stats);
+
 #endif
@@ -100,8 +100,8 @@ int main(int argc, char *argv[])
       if (i == j) continue;
       tgt_start = malloc_items[j].address;
       tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
-      if (((start >= tgt_start) && (start <= tgt_end)) ||
-	  ((end >= tgt_start) && (end <= tgt_end))) {
+      if (((start >= tgt_start) && (start < tgt_end)) ||
+	  ((end > tgt_start) && (end <= tgt_end))) {
 	fail = 1;
 	break;
       } //if
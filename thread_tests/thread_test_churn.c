@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "my_malloc.h"
+
+#ifdef LOCK_VERSION
+#define MALLOC(sz) ts_malloc_lock(sz)
+#define FREE(p)    ts_free_lock(p)
+char * s = "Testing lock version.....";
+#endif
+#ifdef NOLOCK_VERSION
+#define MALLOC(sz) ts_malloc_nolock(sz)
+#define FREE(p)    ts_free_nolock(p)
+char * s = "Testing TLS version......";
+#endif
+
+//Rounds of short lived threads that replace random items of a shared
+//working set, so blocks are freed by other threads than the ones that
+//allocated them and heaps pass from exited threads to new ones. Memory
+//freed by one thread has to be reused by the others: the test fails if
+//after any round the footprint is more than MAX_OVERHEAD times the most
+//bytes live in the working set at the end of a round so far.
+#define NUM_THREADS  8
+#define NUM_ROUNDS   30
+#define REPORT       5 //rounds between reports
+#define MAX_OVERHEAD 4
+#define NUM_OPS      20000
+#define WORKING_SET  2048
+#define MAX_SHIFT    19 //sizes from 16 bytes up to 1 MB
+
+pthread_t threads[NUM_THREADS];
+int       thread_id[NUM_THREADS];
+
+void * volatile items[WORKING_SET]; //each item starts with its size
+size_t live; //bytes of all items
+
+
+void drop_item(void *p) {
+  if (p != NULL) {
+    __atomic_sub_fetch(&live, *(size_t *)p, __ATOMIC_RELAXED);
+    FREE(p);
+  } //if
+}
+
+
+void do_churn(unsigned seed) {
+  int i, slot;
+  void *p;
+
+  for (i=0; i < NUM_OPS; i++) {
+    //Replace a random item by one of a random size, small sizes
+    //are as likely as large ones on a log scale
+    slot = rand_r(&seed) % WORKING_SET;
+    drop_item(__atomic_exchange_n(&items[slot], NULL, __ATOMIC_ACQ_REL));
+    int shift = 4 + rand_r(&seed) % (MAX_SHIFT - 3);
+    size_t bytes = ((size_t)1 << shift) + rand_r(&seed) % ((size_t)1 << shift);
+    p = MALLOC(bytes);
+    memset(p, 1, bytes < 64 ? bytes : 64);
+    *(size_t *)p = bytes;
+    __atomic_add_fetch(&live, bytes, __ATOMIC_RELAXED);
+    drop_item(__atomic_exchange_n(&items[slot], p, __ATOMIC_ACQ_REL));
+  } //for i
+}
+
+
+void *churn(void *arg) {
+  int id = *((int *) arg);
+  do_churn(id);
+  return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+#if defined(LOCK_VERSION) || defined(NOLOCK_VERSION)
+  printf("%s\n", s);
+#endif
+  int i, round, failed = 0;
+  size_t footprint, peak = 0;
+
+  for (round=1; round <= NUM_ROUNDS; round++) {
+    for (i=0; i < NUM_THREADS; i++) {
+      thread_id[i] = round * NUM_THREADS + i;
+      pthread_create(&threads[i], NULL, churn, (void *)(&thread_id[i]));
+    } //for i
+    for (i=0; i < NUM_THREADS; i++) {
+      pthread_join(threads[i], NULL);
+    } //for i
+
+    footprint = ts_footprint();
+    if (live > peak) {
+      peak = live;
+    } //if
+    if (round % REPORT == 0) {
+      printf("Round = %2d  Footprint = %.1f MB  Live = %.1f MB\n", round, footprint / 1e6, live / 1e6);
+    } //if
+    if (footprint > MAX_OVERHEAD * peak && !failed) {
+      printf("Footprint %.1f MB for at most %.1f MB live after round %d\n", footprint / 1e6, peak / 1e6, round);
+      failed = 1;
+    } //if
+  } //for round
+
+  for (i=0; i < WORKING_SET; i++) {
+    drop_item(items[i]);
+  } //for i
+
+  if (failed) {
+    printf("Test failed\n");
+  } else {
+    printf("Test passed\n");
+  } //else
+
+  return 0;
+}
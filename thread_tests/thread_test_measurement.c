@@ -86,6 +86,29 @@ void do_allocate(int thread_id) {
 }
 
 
+#ifdef THP_REPORT
+//Sum the anonymous memory of all mappings and the part of it
+//that is backed by transparent hugepages
+void thp_coverage(unsigned long *anon_kb, unsigned long *huge_kb) {
+  char line[256];
+  unsigned long kb;
+  FILE *f = fopen("/proc/self/smaps", "r");
+
+  *anon_kb = 0;
+  *huge_kb = 0;
+  if (f == NULL) return;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "Anonymous: %lu kB", &kb) == 1) {
+      *anon_kb += kb;
+    } else if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) {
+      *huge_kb += kb;
+    } //else
+  } //while
+  fclose(f);
+}
+#endif
+
+
 void *allocate(void *arg) {
   int id = *((int *) arg);
   do_allocate(id);
@@ -101,6 +124,7 @@ int main(int argc, char *argv[])
   int i, j;
   struct timespec start_time, end_time;
   void *start_segment_addr, *end_segment_addr;
+  size_t start_footprint, end_footprint; //heaps are not in the data segment
 
   srand(0);
 
@@ -117,6 +141,7 @@ int main(int argc, char *argv[])
   pthread_barrier_init(&barrier, NULL, NUM_THREADS);
 
   start_segment_addr = sbrk(0);
+  start_footprint = ts_footprint();
   clock_gettime(CLOCK_MONOTONIC, &start_time);
   for (i=0; i < NUM_THREADS; i++) {
     thread_id[i] = i;
@@ -127,6 +152,11 @@ int main(int argc, char *argv[])
   } //for i
   clock_gettime(CLOCK_MONOTONIC, &end_time);
   end_segment_addr = sbrk(0);
+  end_footprint = ts_footprint();
+#ifdef THP_REPORT
+  unsigned long anon_kb, huge_kb;
+  thp_coverage(&anon_kb, &huge_kb);
+#endif
 
   //Check for correctness!
 
@@ -142,8 +172,8 @@ int main(int argc, char *argv[])
       if (i == j) continue;
       tgt_start = malloc_items[j].address;
       tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
-      if (((start >= tgt_start) && (start <= tgt_end)) ||
-	  ((end >= tgt_start) && (end <= tgt_end))) {
+      if (((start >= tgt_start) && (start < tgt_end)) ||
+	  ((end > tgt_start) && (end <= tgt_end))) {
 	fail = 1;
 	break;
       } //if
@@ -170,7 +200,12 @@ int main(int argc, char *argv[])
 
   double elapsed_ns = calc_time(start_time, end_time);
   printf("Execution Time = %f seconds\n", elapsed_ns / 1e9);
-  printf("Data Segment Size = %lu bytes\n", (unsigned long)(end_segment_addr - start_segment_addr));
+  printf("Data Segment Size = %lu bytes\n", (unsigned long)(end_segment_addr - start_segment_addr)
+	 + (unsigned long)(end_footprint - start_footprint));
+#ifdef THP_REPORT
+  printf("THP Coverage = %lu of %lu kB anonymous memory (%.1f%%)\n", huge_kb, anon_kb,
+	 anon_kb ? 100.0 * huge_kb / anon_kb : 0.0);
+#endif
 
   return 0;
 }
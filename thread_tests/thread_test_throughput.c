@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "my_malloc.h"
+
+#ifdef LOCK_VERSION
+#define MALLOC(sz) ts_malloc_lock(sz)
+#define FREE(p)    ts_free_lock(p)
+char * s = "Testing lock version.....";
+#endif
+#ifdef NOLOCK_VERSION
+#define MALLOC(sz) ts_malloc_nolock(sz)
+#define FREE(p)    ts_free_nolock(p)
+char * s = "Testing TLS version......";
+#endif
+
+//Throughput of malloc/free pairs for 1, 2, 4, ... MAX_THREADS threads.
+//Build the library with LOCK=-DPTHREAD_LOCKS to compare its locks
+//against pthread mutexes, and with LOCK=-DLOCK_STATS to see how often
+//they were contended.
+#define MAX_THREADS  16
+#define NUM_OPS      1000000
+#define WORKING_SET  64
+#define MAX_SHIFT    13 //sizes from 16 bytes up to 16 KB
+
+double calc_time(struct timespec start, struct timespec end) {
+  double start_sec = (double)start.tv_sec*1000000000.0 + (double)start.tv_nsec;
+  double end_sec = (double)end.tv_sec*1000000000.0 + (double)end.tv_nsec;
+
+  if (end_sec < start_sec) {
+    return 0;
+  } else {
+    return end_sec - start_sec;
+  }
+};
+
+
+pthread_t threads[MAX_THREADS];
+int       thread_id[MAX_THREADS];
+
+pthread_barrier_t barrier;
+
+
+void do_allocate(int thread_id) {
+  int i, slot;
+  unsigned seed = thread_id + 1;
+  void *items[WORKING_SET] = {NULL};
+
+  pthread_barrier_wait(&barrier);
+
+  for (i=0; i < NUM_OPS; i++) {
+    //Replace a random item by one of a random size, small sizes
+    //are as likely as large ones on a log scale
+    slot = rand_r(&seed) % WORKING_SET;
+    FREE(items[slot]);
+    int shift = 4 + rand_r(&seed) % (MAX_SHIFT - 3);
+    size_t bytes = ((size_t)1 << shift) + rand_r(&seed) % ((size_t)1 << shift);
+    items[slot] = MALLOC(bytes);
+    *(char *)items[slot] = 1;
+  } //for i
+
+  for (i=0; i < WORKING_SET; i++) {
+    FREE(items[i]);
+  } //for i
+}
+
+
+void *allocate(void *arg) {
+  int id = *((int *) arg);
+  do_allocate(id);
+  return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+#if defined(LOCK_VERSION) || defined(NOLOCK_VERSION)
+  printf("%s\n", s);
+#endif
+  int i, num_threads;
+  struct timespec start_time, end_time;
+  LockStats stats;
+
+  for (num_threads=1; num_threads <= MAX_THREADS; num_threads *= 2) {
+    pthread_barrier_init(&barrier, NULL, num_threads);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (i=0; i < num_threads; i++) {
+      thread_id[i] = i;
+      pthread_create(&threads[i], NULL, allocate, (void *)(&thread_id[i]));
+    } //for i
+    for (i=0; i < num_threads; i++) {
+      pthread_join(threads[i], NULL);
+    } //for i
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    pthread_barrier_destroy(&barrier);
+
+    double elapsed_ns = calc_time(start_time, end_time);
+    printf("Threads = %2d  Throughput = %.2f M malloc/free pairs per second\n", num_threads,
+	   (double)num_threads * NUM_OPS / elapsed_ns * 1e3);
+  } //for num_threads
+
+  ts_lock_stats(&stats);
+  if (stats.acquired > 0) {
+    printf("Lock acquisitions = %lu, contended = %lu, parked = %lu\n",
+	   stats.acquired, stats.contended, stats.parked);
+  } //if
+
+  return 0;
+}